@@ -0,0 +1,143 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compare TimMerge with std::inplace_merge and std::merge on two sorted runs of different shapes.
+// Usage: timmerge_bench [num_elems]
+
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <stdint.h>
+#include "timsort.h"
+
+using namespace std;
+
+static uint64_t gNumCompares = 0;
+
+struct CountingLess
+{
+    bool operator()(int a, int b) const
+    {
+        ++gNumCompares;
+        return a < b;
+    }
+};
+
+double NowInSeconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Fill v with two sorted runs [0, pivot) and [pivot, size) of the given shape.
+void MakeRuns(const string &shape, size_t numElems, vector<int> &v, size_t &pivot)
+{
+    v.resize(numElems);
+    pivot = numElems / 2;
+
+    if (shape == "interleaved") {
+        // Both runs are drawn from the same distribution, so they alternate element by element.
+        for (size_t i = 0; i < numElems; ++i) {
+            v[i] = rand();
+        }
+    } else if (shape == "skewed") {
+        // A small run merged into a large one, as when a batch is merged into a table.
+        pivot = numElems / 100;
+        for (size_t i = 0; i < numElems; ++i) {
+            v[i] = rand();
+        }
+    } else if (shape == "blocks") {
+        // The runs take turns in blocks of 1000 consecutive values.
+        for (size_t i = 0; i < numElems; ++i) {
+            size_t block = i / 1000;
+            v[i] = (i < pivot ? 2 * block : 2 * (block - pivot / 1000) + 1) * 1000 + i % 1000;
+        }
+    } else if (shape == "disjoint") {
+        // All of A is less than all of B except the last element.
+        for (size_t i = 0; i < numElems; ++i) {
+            v[i] = i;
+        }
+        v[pivot - 1] = numElems;
+    }
+
+    sort(v.begin(), v.begin() + pivot);
+    sort(v.begin() + pivot, v.end());
+}
+
+void Report(const string &shape, const string &name, double seconds, size_t numElems)
+{
+    cout << setw(12) << shape << setw(22) << name
+         << setw(12) << fixed << setprecision(3) << seconds * 1e3 << " ms"
+         << setw(12) << setprecision(2) << seconds * 1e9 / numElems << " ns/elem"
+         << setw(12) << setprecision(3) << static_cast<double>(gNumCompares) / numElems << " cmp/elem" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t numElems = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    if (numElems < 2) {
+        cerr << "Usage: timmerge_bench [num_elems], with num_elems >= 2" << endl;
+        return 1;
+    }
+    const char *shapes[] = { "interleaved", "skewed", "blocks", "disjoint" };
+
+    srand(2011);
+    cout << "num elems: " << numElems << endl;
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); ++s) {
+        vector<int> input;
+        size_t pivot;
+        MakeRuns(shapes[s], numElems, input, pivot);
+
+        vector<int> v = input;
+        gNumCompares = 0;
+        double start = NowInSeconds();
+        TimMerge(v.begin(), v.begin() + pivot, v.end(), CountingLess());
+        Report(shapes[s], "TimMerge in place", NowInSeconds() - start, numElems);
+        vector<int> gold = v;
+
+        v = input;
+        gNumCompares = 0;
+        start = NowInSeconds();
+        inplace_merge(v.begin(), v.begin() + pivot, v.end(), CountingLess());
+        Report(shapes[s], "std::inplace_merge", NowInSeconds() - start, numElems);
+        if (v != gold) {
+            cerr << "Results differ on " << shapes[s] << endl;
+            return 1;
+        }
+
+        v.assign(numElems, 0);
+        gNumCompares = 0;
+        start = NowInSeconds();
+        TimMerge(input.begin(), input.begin() + pivot, input.begin() + pivot, input.end(), v.begin(), CountingLess());
+        Report(shapes[s], "TimMerge to out", NowInSeconds() - start, numElems);
+        if (v != gold) {
+            cerr << "Results differ on " << shapes[s] << endl;
+            return 1;
+        }
+
+        gNumCompares = 0;
+        start = NowInSeconds();
+        merge(input.begin(), input.begin() + pivot, input.begin() + pivot, input.end(), v.begin(), CountingLess());
+        Report(shapes[s], "std::merge", NowInSeconds() - start, numElems);
+    }
+
+    return 0;
+}
@@ -19,20 +19,373 @@
 
 #include <functional>
 #include <algorithm>
+#include <vector>
+#include <utility>
 #include <cassert>
 #include <cmath>
+#include <ctime>
 #include <stdint.h>
 
+// USDT probes for bpftrace and perf on Linux, compiled in when <sys/sdt.h> (systemtap-sdt-dev) is available.
+// Define TIMSORT_NO_PROBES to leave them out.
+#if !defined(TIMSORT_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TIMSORT_HAVE_PROBES
+#endif
+#endif
+
 // ==================
 // Declaration
 // ==================
 
+// The thread local storage of the phase timers.
+#if defined(_MSC_VER)
+#define TIMSORT_THREAD_LOCAL __declspec(thread)
+#else
+#define TIMSORT_THREAD_LOCAL __thread
+#endif
+
+// The phase timers read the TSC where it is one instruction away, and the monotonic clock elsewhere.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TIMSORT_PHASE_CLOCK_TSC
+#endif
+
 template <typename RandomAccessIterator>
 inline void TimSort(RandomAccessIterator first, RandomAccessIterator last);
 
 template <typename RandomAccessIterator, typename Compare>
 inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, Compare compare);
 
+// What one or more sorts did. The TimSort overloads that take it add their counts to it.
+struct TimSortStats
+{
+    static const size_t kNumSizeClasses = 64;
+
+    uint64_t mNumCompares;         // Comparator calls
+    uint64_t mNumMoves;            // Element assignments by run reversal, insertion and merging
+    uint64_t mNumNaturalRuns;      // Runs pushed at their natural length
+    uint64_t mNumBoostedRuns;      // Runs extended to minrun by binary insertion
+    uint64_t mNumMerges;           // MergeAt calls
+    uint64_t mNumMergedElems;      // The total length of the runs given to MergeAt
+    uint64_t mNumMergesBySize[kNumSizeClasses];  // MergeAt calls by floor(log2(the length of both runs))
+    uint64_t mNumGallops;          // Entries into the galloping mode of MergeLow/MergeHigh
+    uint64_t mGallopNanos;         // The time spent in the galloping mode
+    size_t mFinalMinGallop;        // minGallop at the end of the last sort
+    size_t mPeakMergeAreaBytes;    // The largest merge area
+    uint64_t mNumAllocations;      // Allocations of the merge area
+
+    TimSortStats() { Clear(); }
+
+    void Clear()
+    {
+        mNumCompares = 0;
+        mNumMoves = 0;
+        mNumNaturalRuns = 0;
+        mNumBoostedRuns = 0;
+        mNumMerges = 0;
+        mNumMergedElems = 0;
+        std::fill(mNumMergesBySize, mNumMergesBySize + kNumSizeClasses, 0);
+        mNumGallops = 0;
+        mGallopNanos = 0;
+        mFinalMinGallop = 0;
+        mPeakMergeAreaBytes = 0;
+        mNumAllocations = 0;
+    }
+};
+
+// The same as TimSort, and count what the sort does in stats.
+// The instrumentation is compiled only into these overloads, the others do not pay for it.
+template <typename RandomAccessIterator>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, TimSortStats &stats);
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, Compare compare, TimSortStats &stats);
+
+/**
+ * The events of a sort, for tracing. Every event does nothing here.
+ *
+ * A tracer derives from TimSortHooks and hides the events it needs with functions of the same names.
+ * The hooks are a compile-time policy: the events are resolved statically and the empty ones compile to nothing.
+ * The iterators are those of the sorted range. Runs are half-open ranges [first, last), and the merged runs
+ * are adjacent: A is [firstA, firstB) and B is [firstB, lastB).
+ * A sort taken by the low cardinality path reports only comparisons and moves, unless a value beyond its limit
+ * sends the rest of the input to the runs.
+ */
+struct TimSortHooks
+{
+    // A sort of [first, last) started.
+    template <typename Iterator>
+    inline void OnSortBegin(Iterator /* first */, Iterator /* last */) {}
+
+    // The comparator was called.
+    inline void OnCompare() {}
+
+    // numElems elements were assigned.
+    inline void OnMove(size_t /* numElems */) {}
+
+    // A natural run was found. A descending run has been reversed in place already.
+    template <typename Iterator>
+    inline void OnRunDetected(Iterator /* first */, Iterator /* last */, bool /* isDescending */) {}
+
+    // The natural run [first, naturalLast) was extended to [first, last) by binary insertion.
+    template <typename Iterator>
+    inline void OnRunBoosted(Iterator /* first */, Iterator /* naturalLast */, Iterator /* last */) {}
+
+    // The run was pushed to the stack, which then holds stackSize runs.
+    template <typename Iterator>
+    inline void OnRunPushed(Iterator /* first */, Iterator /* last */, size_t /* stackSize */) {}
+
+    // The runs at stackPos and stackPos + 1 of the stack are merged.
+    template <typename Iterator>
+    inline void OnMergeBegin(size_t /* stackPos */, Iterator /* firstA */, Iterator /* firstB */, Iterator /* lastB */) {}
+
+    // The merge started by the last OnMergeBegin produced the run [first, last).
+    template <typename Iterator>
+    inline void OnMergeEnd(Iterator /* first */, Iterator /* last */) {}
+
+    // A merge entered or left its galloping mode.
+    inline void OnGallopEnter() {}
+    inline void OnGallopExit() {}
+
+    // The merge area was allocated with the given size in bytes.
+    inline void OnMergeAreaGrow(size_t /* bytes */) {}
+
+    // A reversed run, an insertion or a merge removed numInversions inversions.
+    inline void OnInversions(uint64_t /* numInversions */) {}
+
+    // The sort finished with the given minGallop.
+    inline void OnSortEnd(size_t /* minGallop */) {}
+};
+
+// The same as TimSort, and report the events of the sort to hooks, an object of a class derived from TimSortHooks.
+template <typename RandomAccessIterator, typename Compare, typename HooksType>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, Compare compare, HooksType &hooks);
+
+enum TimSortPhase
+{
+    kTimPhaseRunDetection,   // Scanning for natural runs and reversing the descending ones
+    kTimPhaseBoosting,       // Extending short runs by binary insertion
+    kTimPhaseMerging,        // Merging runs one pair of elements at a time
+    kTimPhaseGalloping,      // Merging runs in the galloping mode
+    kTimPhaseOther,          // The low cardinality path and the bookkeeping of the run stack
+    kTimNumPhases
+};
+
+// What the ticks of the phase timers count.
+enum TimSortTickUnit
+{
+    kTimTickCycles,     // TSC cycles, on x86 with GCC or Clang
+    kTimTickNanos       // Nanoseconds of CLOCK_MONOTONIC_RAW, elsewhere
+};
+
+// The time the timed sorts of a thread spent in each phase.
+struct TimSortPhaseTimes
+{
+    uint64_t mTicks[kTimNumPhases];
+    TimSortTickUnit mTickUnit;  // The unit of mTicks, the same for all threads
+    uint64_t mNumSorts;
+    uint64_t mNumElems;
+
+    void Clear()
+    {
+        std::fill(mTicks, mTicks + kTimNumPhases, 0);
+        mTickUnit = GetPlatformTickUnit();
+        mNumSorts = 0;
+        mNumElems = 0;
+    }
+
+    static TimSortTickUnit GetPlatformTickUnit()
+    {
+#ifdef TIMSORT_PHASE_CLOCK_TSC
+        return kTimTickCycles;
+#else
+        return kTimTickNanos;
+#endif
+    }
+};
+
+// The same as TimSort, and add the time spent in each phase to the totals of the calling thread.
+// A phase transition costs two clock reads, so the timed sort can stay on for a sample of the sorts:
+// call it instead of TimSort for, say, one sort in a hundred.
+template <typename RandomAccessIterator>
+inline void TimSortTimed(RandomAccessIterator first, RandomAccessIterator last);
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimSortTimed(RandomAccessIterator first, RandomAccessIterator last, Compare compare);
+
+// The phase times of the timed sorts run by the calling thread since the last clear.
+inline const TimSortPhaseTimes &TimSortGetPhaseTimes();
+
+inline void TimSortClearPhaseTimes();
+
+// Sort [first, last) and return its number of inversions, the pairs i < j with *j < *i before the sort.
+// The inversions are counted by the merges as they move the elements, so the count costs no extra pass.
+template <typename RandomAccessIterator>
+inline uint64_t TimSortCountInversions(RandomAccessIterator first, RandomAccessIterator last);
+
+template <typename RandomAccessIterator, typename Compare>
+inline uint64_t TimSortCountInversions(RandomAccessIterator first, RandomAccessIterator last, Compare compare);
+
+// Sort [first, last) when the prefix [first, middle) is already sorted, e.g. after appending a batch to a sorted vector.
+// Only the appended tail [middle, last) is scanned for runs, the prefix is reused as one run and merged at the end.
+template <typename RandomAccessIterator>
+inline void TimSortAppend(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last);
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimSortAppend(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare compare);
+
+// Sort [first, last) whose elements are at most k positions away from their sorted positions,
+// e.g. events delayed by network jitter. The work is O(n log k) however short the natural runs are.
+// Returns false if the input broke the bound. It is then sorted anyway, by the full sort.
+template <typename RandomAccessIterator>
+inline bool TimSortBounded(RandomAccessIterator first, RandomAccessIterator last, size_t k);
+
+template <typename RandomAccessIterator, typename Compare>
+inline bool TimSortBounded(RandomAccessIterator first, RandomAccessIterator last, size_t k, Compare compare);
+
+// Which one of a group of equal elements TimSortUnique keeps, in the input order.
+enum TimUniquePolicy
+{
+    kTimKeepFirst,
+    kTimKeepLast
+};
+
+// Sort [first, last) and remove the equal elements in the same pass, as TimSort followed by std::unique would.
+// The duplicates are dropped as soon as they meet, in the runs and in every merge, so later merges move less data.
+// Returns the new end of the range. The elements in [return, last) are unspecified.
+template <typename RandomAccessIterator>
+inline RandomAccessIterator TimSortUnique(
+        RandomAccessIterator first, RandomAccessIterator last, TimUniquePolicy policy = kTimKeepFirst);
+
+template <typename RandomAccessIterator, typename Compare>
+inline RandomAccessIterator TimSortUnique(
+        RandomAccessIterator first, RandomAccessIterator last, Compare compare, TimUniquePolicy policy = kTimKeepFirst);
+
+// Sort [first, last) and aggregate every group of equal elements into one, e.g. to sum or count by key.
+// reduce(kept, next) folds the element next into kept, which comes before it in the input. It is called as soon as
+// two equal elements meet, in the runs and in every merge, so it must be associative: the groups are folded in
+// input order, but not from left to right. Returns the new end of the range.
+template <typename RandomAccessIterator, typename Compare, typename Reduce>
+inline RandomAccessIterator TimSortReduce(
+        RandomAccessIterator first, RandomAccessIterator last, Compare compare, Reduce reduce);
+
+// Rearrange [first, last) so that [first, middle) holds its smallest middle - first elements in stable sorted order.
+// The order of the rest elements in [middle, last) is unspecified.
+template <typename RandomAccessIterator>
+inline void TimPartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last);
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimPartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare compare);
+
+// Copy the smallest k elements of [first, last) to out in stable sorted order. The input is not modified.
+// Returns the end of the output range.
+template <typename RandomAccessIterator, typename OutputIterator>
+inline OutputIterator TimTopK(RandomAccessIterator first, RandomAccessIterator last, size_t k, OutputIterator out);
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimTopK(RandomAccessIterator first, RandomAccessIterator last, size_t k, OutputIterator out, Compare compare);
+
+// Merge the sorted ranges [ranges[i].first, ranges[i].second) to out in one pass. The merge is stable:
+// equal elements are written in the order of their ranges. Returns the end of the output range.
+template <typename RandomAccessIterator, typename OutputIterator>
+inline OutputIterator TimMergeK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out);
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimMergeK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+        Compare compare);
+
+// Merge the two consecutive sorted ranges [first, middle) and [middle, last) in place, like std::inplace_merge.
+// Uses the galloping merge of TimSort and a temporary area of the size of the smaller range.
+template <typename RandomAccessIterator>
+inline void TimMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last);
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare compare);
+
+// Merge the sorted ranges [firstA, lastA) and [firstB, lastB) to out, like std::merge, with galloping.
+// Returns the end of the output range.
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimMerge(
+        RandomAccessIterator1 firstA, RandomAccessIterator1 lastA, RandomAccessIterator2 firstB, RandomAccessIterator2 lastB,
+        OutputIterator out);
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimMerge(
+        RandomAccessIterator1 firstA, RandomAccessIterator1 lastA, RandomAccessIterator2 firstB, RandomAccessIterator2 lastB,
+        OutputIterator out, Compare compare);
+
+// Set operations on sorted ranges with the same results as std::set_intersection, std::set_union and
+// std::set_difference. They skip over non-matching stretches by galloping from the current position, so the cost
+// depends on the gaps between matches, not on the length of the longer range.
+// E.g. intersecting m elements with n >> m elements costs about O(m log(n/m)) comparisons.
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimSetIntersection(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out);
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetIntersection(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare compare);
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimSetUnion(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out);
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetUnion(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare compare);
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimSetDifference(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out);
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetDifference(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare compare);
+
+// Batched finger search: write std::lower_bound(first, last, *needle) for each needle of [needleFirst, needleLast) to
+// out, as an iterator into [first, last). Each search gallops from the result of the previous one, so a sorted or
+// nearly sorted batch of k needles costs about O(k log(n/k)) comparisons instead of O(k log(n)).
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator>
+inline OutputIterator TimLowerBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out);
+
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimLowerBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out, Compare compare);
+
+// The same as TimLowerBounds for std::upper_bound.
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator>
+inline OutputIterator TimUpperBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out);
+
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimUpperBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out, Compare compare);
+
+// Intersect k sorted ranges. An element is written as many times as it occurs in every range, taken from ranges[0],
+// i.e. the result of folding std::set_intersection over the ranges.
+template <typename RandomAccessIterator, typename OutputIterator>
+inline OutputIterator TimSetIntersectionK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out);
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetIntersectionK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+        Compare compare);
+
 // ==================
 // Implementation
 // ==================
@@ -51,6 +404,19 @@ private:
     // The initial size of merge area. This value can be changed for performance.
     static const size_t kInitMergeAreaSize = 256;
 
+    // The low cardinality path of Sort handles at most this many distinct values. It must fit the uint8_t ids.
+    static const size_t kMaxFewDistinct = 256;
+
+    // The number of evenly spaced elements checked before trying the low cardinality path, and the minimal input size.
+    static const size_t kFewDistinctSampleSize = 512;
+    static const size_t kMinFewDistinctLength = 8192;
+
+    // Up to this displacement bound, SortBounded inserts each element by a linear scan from its left neighbour.
+    static const size_t kMaxLinearInsertionBound = 128;
+
+    // The largest key domain that the counting sort of integers indexes directly.
+    static const size_t kMaxCountingDomain = 65536;
+
 public:
     template <typename RandomAccessIterator>
     static void Sort(RandomAccessIterator first, RandomAccessIterator last);
@@ -58,6 +424,156 @@ public:
     template <typename RandomAccessIterator, typename Compare>
     static void Sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
 
+    /**
+     * The same as above, with comp wrapped so that the sort reports its events to hooks.
+     */
+    template <typename RandomAccessIterator, typename Compare, typename HooksType>
+    static void Sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, HooksType &hooks);
+
+    template <typename RandomAccessIterator, typename Compare>
+    static void Sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, TimSortStats &stats);
+
+    /**
+     * The same as above, and add the time spent in each phase to ThreadPhaseTimes().
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void SortTimed(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+
+    // The phase times of the calling thread. They start cleared.
+    static inline TimSortPhaseTimes &ThreadPhaseTimes()
+    {
+        static TIMSORT_THREAD_LOCAL TimSortPhaseTimes times;
+        return times;
+    }
+
+    /**
+     * Sort [first, last) by finding its runs and merging them, without the low cardinality path.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void SortRuns(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Sort [first, last) and return the number of inversions removed on the way:
+     * the pairs of each reversed descending run, the elements each insertion moves over,
+     * and in the merges, for each element of B, the elements of A it moves before.
+     * The kernels report them with OnInversions, which only the hooks of this sort count.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static uint64_t CountInversions(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Sort [first, last) whose prefix [first, middle) is already sorted.
+     * The prefix is reported to the hooks as the first run pushed.
+     * REQUIRES: [first, middle) is sorted by comp.
+     * @return The minGallop after the merges, for OnSortEnd.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static size_t SortAppended(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Sort [first, last) whose elements are at most k positions away from their place.
+     * For a small k, each element is inserted by a linear scan from its left neighbour, which it passes at most 2k times.
+     * Otherwise the input is sorted in chunks of k elements, each merged with the unfinished tail of the ones before.
+     * Only the last k elements of the merged tail can still move, the others are final. The boundary with the final
+     * elements is checked after each chunk, and a violation of the bound falls back to SortAppended.
+     * @return false if the bound was violated.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static bool SortBounded(RandomAccessIterator first, RandomAccessIterator last, size_t k, Compare comp);
+
+    /**
+     * Sort [first, last) and fold every group of equal elements into its first element with reduce(kept, next),
+     * in the input order. The groups shrink to one element in the runs and in every merge.
+     * @return The end of the sorted distinct elements, which start at first.
+     */
+    template <typename RandomAccessIterator, typename Compare, typename Reduce>
+    static RandomAccessIterator SortReduce(RandomAccessIterator first, RandomAccessIterator last, Compare comp, Reduce reduce);
+
+    // The reductions of TimSortUnique.
+    struct KeepFirst
+    {
+        template <typename T>
+        inline void operator()(T &, const T &) const {}
+    };
+
+    struct KeepLast
+    {
+        template <typename T>
+        inline void operator()(T &kept, const T &next) const { kept = next; }
+    };
+
+    /**
+     * Put the smallest middle - first elements of [first, last) in [first, middle) in stable sorted order.
+     * [first, middle) is used as the k-buffer. The prefixes of the natural runs of [middle, last) that can enter it
+     * are gathered into batches of k elements, and each batch is sorted and merged into it, O(n log k) in all.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void PartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Copy the smallest k elements of [first, last) to out in stable sorted order without modifying the input.
+     */
+    template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+    static OutputIterator TopK(RandomAccessIterator first, RandomAccessIterator last, size_t k, OutputIterator out, Compare comp);
+
+    /**
+     * Merge the two consecutive sorted runs [first, middle) and [middle, last) in place.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void Merge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Merge the sorted ranges A [firstA, lastA) and B [firstB, lastB) to out in a stable way.
+     * As in MergeAt, the head of A and the tail of B that are already in place are found by galloping first.
+     * The rest is merged like MergeLow: one pair at a time, switching to galloping when one run wins consistently.
+     */
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+    static OutputIterator MergeTo(
+            RandomAccessIterator1 firstA, RandomAccessIterator1 lastA, RandomAccessIterator2 firstB, RandomAccessIterator2 lastB,
+            OutputIterator out, Compare comp);
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+    static OutputIterator SetIntersection(
+            RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+            OutputIterator out, Compare comp);
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+    static OutputIterator SetUnion(
+            RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+            OutputIterator out, Compare comp);
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+    static OutputIterator SetDifference(
+            RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+            OutputIterator out, Compare comp);
+
+    /**
+     * Leapfrog intersection: the largest head seen so far is the candidate. Each range in turn gallops to the candidate,
+     * and the candidate is output once all k ranges agree on it.
+     */
+    template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+    static OutputIterator SetIntersectionK(
+            const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+            Compare comp);
+
+    /**
+     * Find the lower (or upper) bound of each needle in [first, last), using the previous result as the hint.
+     */
+    template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator, typename Compare>
+    static OutputIterator FingerSearch(
+            RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+            OutputIterator out, bool isUpperBound, Compare comp);
+
+    /**
+     * Merge k sorted ranges to out with a loser tree.
+     * Like MergeLow/MergeHigh, it switches to galloping when one range wins minGallop times in a row,
+     * and then copies whole blocks of the winner up to the head of the runner-up.
+     */
+    template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+    static OutputIterator MergeK(
+            const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+            Compare comp);
+
 private:
     /**
      * The run is [first, last)
@@ -86,12 +602,12 @@ private:
         Run<RandomAccessIterator> mStack[TimSortImpl::kMaxMergeStackSize];
 
         size_t mMinGallop;
-        
+
         // The temporary area for merging two runs.
         std::vector<typename RandomAccessIterator::value_type> mMergeArea;
 
         MergeState(size_t arraySize)
-            : mArraySize(arraySize), mNumRunInStack(0), mMinGallop(TimSortImpl::kMinGallop) 
+            : mArraySize(arraySize), mNumRunInStack(0), mMinGallop(TimSortImpl::kMinGallop)
         {
             mMergeArea.reserve(TimSortImpl::kInitMergeAreaSize);
         };
@@ -116,123 +632,567 @@ private:
                     newSize = requiredSize;
                 } else {
                     // We need array_size/2 merging area at most.
-                    newSize = std::min<uint32_t>(newSize, mArraySize >> 1);
+                    newSize = std::max<uint32_t>(std::min<uint32_t>(newSize, mArraySize >> 1), requiredSize);
                 }
-                
+
+                // The merge runs copy into the area through its iterators, so the elements must exist.
+                // Reserve first, resize alone may grow the capacity beyond the bound above.
                 mMergeArea.reserve(newSize);
+                mMergeArea.resize(newSize);
             }
         }
     };
 
-    template <typename RandomAccessIterator, typename Compare>
-    static void BinaryInsertionSort(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
-
-    /**
-     * Calculate the min run length. 
-     * Trying to make n/minrun_size is exact the power of 2. If impossible, then close to, but strictly less than, an exact power of 2.
-     * If n < MAX_MINRUN_SIZE, return n
-     * else if n is an exact power of 2, return MAX_MINRUN_SIZE/2
-     * else return an integer k, such that n/k is close to, but strictly less than, an exact power of 2.
-     * @param n The array size.
-     */
-    static inline size_t CalcMinRunLength(size_t n);
-
     /**
-     * Make the descending run be ascending. The run is [first, last)
-     * REQUIRES: The input sequence must be descending.
+     * Detect the runs in [first, last), boost the short ones and push them to the merge stack.
+     * The minrun length is computed from the size of [first, last), not the whole array.
      */
-    template <typename RandomAccessIterator>
-    static inline void ReverseRun(RandomAccessIterator first, RandomAccessIterator last);
+    template <typename RandomAccessIterator, typename Compare>
+    static void PushRuns(MergeState<RandomAccessIterator> &state, RandomAccessIterator first, RandomAccessIterator last, Compare comp);
 
     /**
-     * Detect the run and make it ascending if necessary on the given range [first, last).
-     * @return Return the right boundary of the run. i.e. The run is [first, return).
+     * Sort the batch of candidates [middle, last) and merge it into the sorted k-buffer [first, middle).
+     * The smallest elements end up in the buffer, the others in [middle, last) in any order.
+     * REQUIRES: The buffer elements come before the candidates in the input, so they win the ties.
      */
     template <typename RandomAccessIterator, typename Compare>
-    static RandomAccessIterator DetectRunAndMakeAscending(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+    static void MergeIntoTopK(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp);
 
     /**
-     * Trying to merge the runs in the stack in a stable way.
-     * Two invariants are keeped while merging. Assume A, B and C are the lengths of three rightmost not-ye merged runs:
-     * 1. A > B + C
-     * 2. B > C
-     * Rule 1 implies that the run lengths in the stack grow as fast as the Fibonacci numbers. Then the stack depth is always less than
-     * log_base_phi(N), where phi = (1 + sqrt(5)) / 2 ~= 1.618.
-     *
-     * When it's OK to merge, suppose we need merge A, B and C three runs. Then the rule is:
-     * Choose the smaller runs between A and C to merge with B.
-     * Note: we can NOT merge A and C firstly, then merge with B, since this breaks the stability of the sort.
+     * A loser tree over k sorted ranges. The leaf of range i is node i + k, the parent of node n is n / 2.
+     * Each internal node keeps the loser of the match played there, mTree[0] keeps the overall winner.
+     * An exhausted range loses to all others. Equal heads are won by the range with the smaller index, so the merge is stable.
      */
     template <typename RandomAccessIterator, typename Compare>
-    static inline void TryMerge(MergeState<RandomAccessIterator> &state, Compare comp);
+    struct LoserTree
+    {
+        size_t mNumRanges;
+        std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > mRanges;  // [current head, last) of each range
+        std::vector<size_t> mTree;
+        Compare mComp;
 
-    template <typename RandomAccessIterator, typename Compare>
-    static void ForceMerge(MergeState<RandomAccessIterator> &state, Compare comp);
+        LoserTree(const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, Compare comp);
 
-    /**
-     * Merge the two runs at the given position of the stack(mStack[stackPos] and mStack[stackPos + 1]).
-     */
-    template <typename RandomAccessIterator, typename Compare>
-    static void MergeAt(MergeState<RandomAccessIterator> &state, size_t stackPos, Compare comp);
+        inline bool Beats(size_t a, size_t b) const
+        {
+            const std::pair<RandomAccessIterator, RandomAccessIterator> &ra = mRanges[a];
+            const std::pair<RandomAccessIterator, RandomAccessIterator> &rb = mRanges[b];
+            if (ra.first == ra.second) {
+                return false;
+            }
+            if (rb.first == rb.second) {
+                return true;
+            }
+            // One comparison is enough: on equal heads the smaller index wins.
+            return a < b ? mComp(*rb.first, *ra.first) == false : mComp(*ra.first, *rb.first);
+        }
 
-    /**
-     * Merge two adjacent runs in place in stable way. 
-     * This function is called only when:
-     * 1. The size of range A [firstA, lastA) smaller than or equal to the size of range B [firstB, lastB) AND
-     * 2. The first element of A is greater than first element of B AND
-     * 3. The last element of A is greater than last element of B.
-     */
-    template <typename RandomAccessIterator, typename Compare>
-    static void MergeLow(
-            MergeState<RandomAccessIterator> &state, RandomAccessIterator firstA, RandomAccessIterator lastA,
-            RandomAccessIterator firstB, RandomAccessIterator lastB, Compare comp);
+        inline size_t Winner() const { return mTree[0]; }
 
-    /**
-     * Merge two adjacent runs in place in stable way. 
-     * This function is called only when:
-     * 1. The size of range A [firstA, lastA) larger than or equal to the size of range B [firstB, lastB) AND
-     * 2. The first element of A is greater than first element of B AND
-     * 3. The last element of A is greater than last element of B.
-     */
-    template <typename RandomAccessIterator, typename Compare>
-    static void MergeHigh(
-            MergeState<RandomAccessIterator> &state, RandomAccessIterator firstA, RandomAccessIterator lastA,
-            RandomAccessIterator firstB, RandomAccessIterator lastB, Compare comp);
+        inline bool IsEmpty() const { return mRanges[mTree[0]].first == mRanges[mTree[0]].second; }
+
+        // Replay the matches on the path of the winner after its head has moved.
+        void Replay();
+
+        // The range that would win if the winner were removed, or mNumRanges if all other ranges are exhausted.
+        size_t RunnerUp() const;
+    };
+
+    // The reduction of a plain merge, which keeps the equal elements.
+    struct NoReduce {};
 
     /**
-     * Returns an iterator pointing to the first element in the sorted range [first,last) which does not compare less than value.
-     * The semantic of this function is the same as std::lower_bound().
-     * @param hint The position where to begin the search. The closer hint is to the result, the faster this function will run.
+     * A comparator that also reports the events of the sort to a hooks object.
+     * An instrumented sort runs on it, and the kernels reach the hooks by Hooks(comp). For any other comparator
+     * Hooks(comp) is DefaultHooks, whose calls compile to nothing or to the NOPs of the USDT probes.
      */
-    template <typename RandomAccessIterator, typename Compare>
-    static RandomAccessIterator GallopLeft(
-            RandomAccessIterator first, RandomAccessIterator last, RandomAccessIterator hint,
-            const typename RandomAccessIterator::value_type &value, Compare comp);
+    template <typename Compare, typename HooksType>
+    struct HookedCompare
+    {
+        mutable Compare mComp;
+        HooksType *mHooks;
+
+        HookedCompare(Compare comp, HooksType *hooks) : mComp(comp), mHooks(hooks) {}
+
+        template <typename A, typename B>
+        inline bool operator()(const A &a, const B &b) const
+        {
+            mHooks->OnCompare();
+            return mComp(a, b);
+        }
+    };
 
+#ifdef TIMSORT_HAVE_PROBES
     /**
-     * Returns an iterator pointing to the first element in the sorted range [first,last) which compares greater than value.
-     * The semantic of this function is the same as std::upper_bound().
-     * @param hint The position where to begin the search. The closer hint is to the result, the faster this function will run.
+     * The hooks of the plain sorts fire the USDT probes of the provider timsort. A probe is a NOP until
+     * a tracer attaches to it, e.g. bpftrace -e 'usdt:./a.out:timsort:merge_begin { @[arg0 + arg1] = count(); }'.
+     * The lengths are in elements, and elemSize is in bytes.
      */
-    template <typename RandomAccessIterator, typename Compare>
-    static RandomAccessIterator GallopRight(
-            RandomAccessIterator first, RandomAccessIterator last, RandomAccessIterator hint,
-            const typename RandomAccessIterator::value_type &value, Compare comp);
+    struct DefaultHooks : public TimSortHooks
+    {
+        template <typename Iterator>
+        inline void OnSortBegin(Iterator first, Iterator last)
+        {
+            STAP_PROBE2(timsort, sort_begin, static_cast<size_t>(last - first), sizeof(*first));
+        }
 
-    // for unit test
-    friend class TimSortUT;
-};
+        template <typename Iterator>
+        inline void OnMergeBegin(size_t, Iterator firstA, Iterator firstB, Iterator lastB)
+        {
+            STAP_PROBE3(timsort, merge_begin, static_cast<size_t>(firstB - firstA), static_cast<size_t>(lastB - firstB),
+                        sizeof(*firstA));
+        }
 
-template <typename RandomAccessIterator, typename Compare>
-void TimSortImpl::BinaryInsertionSort(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
-{
-    assert(first < last);
+        template <typename Iterator>
+        inline void OnMergeEnd(Iterator first, Iterator last)
+        {
+            STAP_PROBE1(timsort, merge_end, static_cast<size_t>(last - first));
+        }
 
-    for (RandomAccessIterator i = first + 1; i < last; ++i) {
-        // The sequence [first, i) is in order. Binary search the right position
+        inline void OnGallopEnter() { STAP_PROBE(timsort, gallop_enter); }
+
+        inline void OnGallopExit() { STAP_PROBE(timsort, gallop_exit); }
+
+        inline void OnMergeAreaGrow(size_t bytes) { STAP_PROBE1(timsort, merge_area_grow, bytes); }
+
+        inline void OnSortEnd(size_t minGallop) { STAP_PROBE1(timsort, sort_end, minGallop); }
+    };
+#else
+    typedef TimSortHooks DefaultHooks;
+#endif
+
+    template <typename Compare>
+    static inline DefaultHooks Hooks(const Compare &)
+    {
+        return DefaultHooks();
+    }
+
+    template <typename Compare, typename HooksType>
+    static inline HooksType &Hooks(const HookedCompare<Compare, HooksType> &comp)
+    {
+        return *comp.mHooks;
+    }
+
+    // The hooks of TimSortCountInversions.
+    struct InversionHooks : public TimSortHooks
+    {
+        uint64_t mNumInversions;
+
+        InversionHooks() : mNumInversions(0) {}
+
+        inline void OnInversions(uint64_t numInversions) { mNumInversions += numInversions; }
+    };
+
+    // The hooks that fill a TimSortStats.
+    struct StatsHooks : public TimSortHooks
+    {
+        TimSortStats *mStats;
+        timespec mGallopStart;
+        bool mIsRunBoosted;
+
+        explicit StatsHooks(TimSortStats *stats) : mStats(stats), mIsRunBoosted(false) {}
+
+        inline void OnCompare() { ++mStats->mNumCompares; }
+
+        inline void OnMove(size_t numElems) { mStats->mNumMoves += numElems; }
+
+        template <typename Iterator>
+        inline void OnRunBoosted(Iterator, Iterator, Iterator) { mIsRunBoosted = true; }
+
+        template <typename Iterator>
+        inline void OnRunPushed(Iterator, Iterator, size_t)
+        {
+            ++(mIsRunBoosted ? mStats->mNumBoostedRuns : mStats->mNumNaturalRuns);
+            mIsRunBoosted = false;
+        }
+
+        template <typename Iterator>
+        void OnMergeBegin(size_t, Iterator firstA, Iterator, Iterator lastB)
+        {
+            size_t sizeClass = 0;
+            for (size_t length = lastB - firstA; length > 1; length >>= 1) {
+                ++sizeClass;
+            }
+            ++mStats->mNumMerges;
+            mStats->mNumMergedElems += lastB - firstA;
+            ++mStats->mNumMergesBySize[sizeClass];
+        }
+
+        void OnGallopEnter()
+        {
+            ++mStats->mNumGallops;
+            clock_gettime(CLOCK_MONOTONIC, &mGallopStart);
+        }
+
+        void OnGallopExit()
+        {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            mStats->mGallopNanos += (now.tv_sec - mGallopStart.tv_sec) * 1000000000LL + now.tv_nsec - mGallopStart.tv_nsec;
+        }
+
+        // The merge area was allocated with the given size.
+        inline void OnMergeAreaGrow(size_t bytes)
+        {
+            ++mStats->mNumAllocations;
+            mStats->mPeakMergeAreaBytes = std::max(mStats->mPeakMergeAreaBytes, bytes);
+        }
+
+        inline void OnSortEnd(size_t minGallop) { mStats->mFinalMinGallop = minGallop; }
+    };
+
+    // A cheap monotonic clock for the phase timers.
+    static inline uint64_t ReadPhaseClock()
+    {
+#ifdef TIMSORT_PHASE_CLOCK_TSC
+        uint32_t low;
+        uint32_t high;
+        __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+        return (static_cast<uint64_t>(high) << 32) | low;
+#else
+        timespec now;
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+        return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+    }
+
+    /**
+     * The hooks that time the phases of a sort.
+     * Each transition charges the ticks since the previous one to the phase that ends there. A run detection
+     * is charged as a whole when it ends, because its start is not reported: it follows the previous run
+     * or merge immediately.
+     */
+    struct PhaseHooks : public TimSortHooks
+    {
+        TimSortPhaseTimes *mTimes;
+        TimSortPhase mPhase;     // The phase in progress
+        uint64_t mLastTick;      // The tick of the last transition
+
+        explicit PhaseHooks(TimSortPhaseTimes *times) : mTimes(times), mPhase(kTimPhaseOther), mLastTick(0) {}
+
+        // Charge the ticks since the last transition to phase, and enter nextPhase.
+        inline void Transit(TimSortPhase phase, TimSortPhase nextPhase)
+        {
+            uint64_t tick = ReadPhaseClock();
+            mTimes->mTicks[phase] += tick - mLastTick;
+            mLastTick = tick;
+            mPhase = nextPhase;
+        }
+
+        template <typename Iterator>
+        inline void OnSortBegin(Iterator first, Iterator last)
+        {
+            ++mTimes->mNumSorts;
+            mTimes->mNumElems += last - first;
+            mLastTick = ReadPhaseClock();
+            mPhase = kTimPhaseOther;
+        }
+
+        template <typename Iterator>
+        inline void OnRunDetected(Iterator, Iterator, bool) { Transit(kTimPhaseRunDetection, kTimPhaseBoosting); }
+
+        template <typename Iterator>
+        inline void OnRunBoosted(Iterator, Iterator, Iterator) { Transit(kTimPhaseBoosting, kTimPhaseOther); }
+
+        // An unboosted run leaves only a few cycles in the boosting phase here.
+        template <typename Iterator>
+        inline void OnRunPushed(Iterator, Iterator, size_t) { Transit(mPhase, kTimPhaseOther); }
+
+        template <typename Iterator>
+        inline void OnMergeBegin(size_t, Iterator, Iterator, Iterator) { Transit(mPhase, kTimPhaseMerging); }
+
+        template <typename Iterator>
+        inline void OnMergeEnd(Iterator, Iterator) { Transit(kTimPhaseMerging, kTimPhaseOther); }
+
+        inline void OnGallopEnter() { Transit(kTimPhaseMerging, kTimPhaseGalloping); }
+
+        inline void OnGallopExit() { Transit(kTimPhaseGalloping, kTimPhaseMerging); }
+
+        inline void OnSortEnd(size_t) { Transit(mPhase, kTimPhaseOther); }
+    };
+
+    /**
+     * Make the merge area hold at least requiredSize elements, and report an allocation to the hooks.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static inline void GrowMergeArea(MergeState<RandomAccessIterator> &state, size_t requiredSize, Compare comp)
+    {
+        size_t capacity = state.mMergeArea.capacity();
+        state.EnsureMergeAreaSize(requiredSize);
+        if (state.mMergeArea.capacity() != capacity) {
+            Hooks(comp).OnMergeAreaGrow(state.mMergeArea.capacity() * sizeof(typename RandomAccessIterator::value_type));
+        }
+    }
+
+    template <bool kValue>
+    struct BoolType {};
+
+    // Whether the elements equal under comp are identical, so that a counting sort can rewrite them from their counts.
+    template <typename T, typename Compare>
+    struct IsCountable { static const bool kValue = false; };
+
+    /**
+     * The distinct values met so far, at most kMaxFewDistinct of them.
+     * A value keeps the id of its first appearance. mSortedValues and mSortedIds list the values and their ids
+     * in sorted order for the binary search.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    struct FewDistinctTable
+    {
+        std::vector<typename RandomAccessIterator::value_type> mSortedValues;
+        std::vector<size_t> mSortedIds;
+        Compare mComp;
+
+        explicit FewDistinctTable(Compare comp) : mComp(comp)
+        {
+            mSortedValues.reserve(kMaxFewDistinct);
+            mSortedIds.reserve(kMaxFewDistinct);
+        }
+
+        // Return the id of value, adding it if it is new. Return kMaxFewDistinct if the table is full.
+        size_t Find(const typename RandomAccessIterator::value_type &value);
+    };
+
+    /**
+     * Sort [first, last) by counting when it has at most kMaxFewDistinct distinct values.
+     * A sample decides whether to try. Then one pass classifies every element against the distinct values
+     * without moving it, and a second pass writes them to their places.
+     * @return false, with [first, last) unchanged, if the input does not qualify. The grouping path does not give up
+     * once it has passed the sample: it groups the prefix it classified and sorts the rest with SortAppended.
+     * When it returns true it has reported OnSortEnd.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static bool SortFewDistinct(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+
+    // Counting sort: write each distinct value as many times as it was counted.
+    template <typename RandomAccessIterator, typename Compare>
+    static bool SortFewDistinct(
+            RandomAccessIterator first, RandomAccessIterator last, FewDistinctTable<RandomAccessIterator, Compare> &table,
+            BoolType<true>);
+
+    // Stable grouping sort: record a one-byte id per element, then scatter the elements by id through a buffer
+    // of half the range, the bound of the merge area. Always returns true.
+    template <typename RandomAccessIterator, typename Compare>
+    static bool SortFewDistinct(
+            RandomAccessIterator first, RandomAccessIterator last, FewDistinctTable<RandomAccessIterator, Compare> &table,
+            BoolType<false>);
+
+    template <typename RandomAccessIterator, typename Compare>
+    static void BinaryInsertionSort(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Insertion sort that moves no element more than maxShift positions to the left.
+     * @return last, or the first element that would have to move further. [first, return) is sorted then.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static RandomAccessIterator BoundedInsertionSort(
+            RandomAccessIterator first, RandomAccessIterator last, size_t maxShift, Compare comp);
+
+    /**
+     * Fold every group of equal adjacent elements of the sorted range [first, last) into its first element.
+     * @return The end of the distinct elements.
+     */
+    template <typename RandomAccessIterator, typename Compare, typename Reduce>
+    static RandomAccessIterator ReduceRun(RandomAccessIterator first, RandomAccessIterator last, Compare comp, Reduce reduce);
+
+    /**
+     * Calculate the min run length. 
+     * Trying to make n/minrun_size is exact the power of 2. If impossible, then close to, but strictly less than, an exact power of 2.
+     * If n < MAX_MINRUN_SIZE, return n
+     * else if n is an exact power of 2, return MAX_MINRUN_SIZE/2
+     * else return an integer k, such that n/k is close to, but strictly less than, an exact power of 2.
+     * @param n The array size.
+     */
+    static inline size_t CalcMinRunLength(size_t n);
+
+    /**
+     * Make the descending run be ascending. The run is [first, last)
+     * REQUIRES: The input sequence must be descending.
+     */
+    template <typename RandomAccessIterator>
+    static inline void ReverseRun(RandomAccessIterator first, RandomAccessIterator last);
+
+    /**
+     * Detect the run and make it ascending if necessary on the given range [first, last).
+     * @return Return the right boundary of the run. i.e. The run is [first, return).
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static RandomAccessIterator DetectRunAndMakeAscending(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Trying to merge the runs in the stack in a stable way.
+     * Two invariants are keeped while merging. Assume A, B and C are the lengths of three rightmost not-ye merged runs:
+     * 1. A > B + C
+     * 2. B > C
+     * Rule 1 implies that the run lengths in the stack grow as fast as the Fibonacci numbers. Then the stack depth is always less than
+     * log_base_phi(N), where phi = (1 + sqrt(5)) / 2 ~= 1.618.
+     *
+     * When it's OK to merge, suppose we need merge A, B and C three runs. Then the rule is:
+     * Choose the smaller runs between A and C to merge with B.
+     * Note: we can NOT merge A and C firstly, then merge with B, since this breaks the stability of the sort.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static inline void TryMerge(MergeState<RandomAccessIterator> &state, Compare comp);
+
+    template <typename RandomAccessIterator, typename Compare, typename Reduce>
+    static inline void TryMerge(MergeState<RandomAccessIterator> &state, Compare comp, Reduce reduce);
+
+    template <typename RandomAccessIterator, typename Compare>
+    static void ForceMerge(MergeState<RandomAccessIterator> &state, Compare comp);
+
+    template <typename RandomAccessIterator, typename Compare, typename Reduce>
+    static void ForceMerge(MergeState<RandomAccessIterator> &state, Compare comp, Reduce reduce);
+
+    /**
+     * Merge the two runs at the given position of the stack(mStack[stackPos] and mStack[stackPos + 1]).
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void MergeAt(MergeState<RandomAccessIterator> &state, size_t stackPos, Compare comp);
+
+    template <typename RandomAccessIterator, typename Compare>
+    static inline void MergeAt(MergeState<RandomAccessIterator> &state, size_t stackPos, Compare comp, NoReduce)
+    {
+        MergeAt(state, stackPos, comp);
+    }
+
+    /**
+     * Merge two runs of distinct elements and fold each pair of equal elements into the one of the left run.
+     * The runs need not be adjacent: the merged run starts at the first of the left run and may be shorter than both.
+     * Like MergeLow, the part of the left run that is not in place is moved to the merge area first, and a run
+     * that wins minGallop times in a row is copied up to the head of the other one in one gallop.
+     */
+    template <typename RandomAccessIterator, typename Compare, typename Reduce>
+    static void MergeAt(MergeState<RandomAccessIterator> &state, size_t stackPos, Compare comp, Reduce reduce);
+
+    /**
+     * Merge two adjacent runs in place in stable way. 
+     * This function is called only when:
+     * 1. The size of range A [firstA, lastA) smaller than or equal to the size of range B [firstB, lastB) AND
+     * 2. The first element of A is greater than first element of B AND
+     * 3. The last element of A is greater than last element of B.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void MergeLow(
+            MergeState<RandomAccessIterator> &state, RandomAccessIterator firstA, RandomAccessIterator lastA,
+            RandomAccessIterator firstB, RandomAccessIterator lastB, Compare comp);
+
+    /**
+     * Merge two adjacent runs in place in stable way. 
+     * This function is called only when:
+     * 1. The size of range A [firstA, lastA) larger than or equal to the size of range B [firstB, lastB) AND
+     * 2. The first element of A is greater than first element of B AND
+     * 3. The last element of A is greater than last element of B.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void MergeHigh(
+            MergeState<RandomAccessIterator> &state, RandomAccessIterator firstA, RandomAccessIterator lastA,
+            RandomAccessIterator firstB, RandomAccessIterator lastB, Compare comp);
+
+    /**
+     * Returns an iterator pointing to the first element in the sorted range [first,last) which does not compare less than value.
+     * The semantic of this function is the same as std::lower_bound().
+     * The value may be of another type than the elements if comp can compare them in both orders.
+     * @param hint The position where to begin the search. The closer hint is to the result, the faster this function will run.
+     */
+    template <typename RandomAccessIterator, typename T, typename Compare>
+    static RandomAccessIterator GallopLeft(
+            RandomAccessIterator first, RandomAccessIterator last, RandomAccessIterator hint,
+            const T &value, Compare comp);
+
+    /**
+     * Returns an iterator pointing to the first element in the sorted range [first,last) which compares greater than value.
+     * The semantic of this function is the same as std::upper_bound().
+     * The value may be of another type than the elements if comp can compare them in both orders.
+     * @param hint The position where to begin the search. The closer hint is to the result, the faster this function will run.
+     */
+    template <typename RandomAccessIterator, typename T, typename Compare>
+    static RandomAccessIterator GallopRight(
+            RandomAccessIterator first, RandomAccessIterator last, RandomAccessIterator hint,
+            const T &value, Compare comp);
+
+    // The other headers and the kernel benchmarks reach the kernels through it.
+    friend struct TimSortDetail;
+
+    // for unit test
+    friend class TimSortUT;
+
+};
+
+/**
+ * The kernels of TimSortImpl, for the sorts built on them in the other headers and for the kernel benchmarks.
+ * It is not a public API: the kernels change with the implementation.
+ */
+struct TimSortDetail : private TimSortImpl
+{
+    using TimSortImpl::kMaxMinRunLength;
+    using TimSortImpl::kMaxMergeStackSize;
+    using TimSortImpl::kMinGallop;
+
+    using TimSortImpl::Run;
+    using TimSortImpl::MergeState;
+
+    using TimSortImpl::CalcMinRunLength;
+    using TimSortImpl::ReverseRun;
+    using TimSortImpl::DetectRunAndMakeAscending;
+    using TimSortImpl::BinaryInsertionSort;
+    using TimSortImpl::GallopLeft;
+    using TimSortImpl::GallopRight;
+    using TimSortImpl::MergeLow;
+    using TimSortImpl::MergeHigh;
+    using TimSortImpl::TryMerge;
+    using TimSortImpl::ForceMerge;
+    using TimSortImpl::SortAppended;
+    using TimSortImpl::MergeK;
+    using TimSortImpl::ReadPhaseClock;
+};
+
+template <typename RandomAccessIterator, typename Compare>
+RandomAccessIterator TimSortImpl::BoundedInsertionSort(
+        RandomAccessIterator first, RandomAccessIterator last, size_t maxShift, Compare comp)
+{
+    for (RandomAccessIterator i = first + (first < last); i < last; ++i) {
+        if (comp(*i, *(i - 1)) == false) {
+            continue;
+        }
+
+        // The sequence [first, i) is in order. Scan left for the position, no further than maxShift.
+        typename RandomAccessIterator::value_type value = *i;
+        RandomAccessIterator bound = static_cast<size_t>(distance(first, i)) > maxShift ? i - maxShift : first;
+        if (bound == i) {
+            return i;
+        }
+        RandomAccessIterator j = i - 1;
+        while (j > bound && comp(value, *(j - 1))) {
+            --j;
+        }
+        if (j == bound && j > first && comp(value, *(j - 1))) {
+            return i;
+        }
+
+        std::copy_backward(j, i, i + 1);
+        *j = value;
+    }
+
+    return last;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::BinaryInsertionSort(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+{
+    assert(first < last);
+
+    for (RandomAccessIterator i = first + 1; i < last; ++i) {
+        // The sequence [first, i) is in order. Binary search the right position
         typename RandomAccessIterator::value_type value = *i;
         RandomAccessIterator j = std::upper_bound(first, i, value, comp);
 
+        // The value moves over the elements greater than it.
+        Hooks(comp).OnInversions(distance(j, i));
+        Hooks(comp).OnMove(distance(j, i) + 2);
         std::copy_backward(j, i, i + 1);
         *j = value;
     }
@@ -273,14 +1233,20 @@ RandomAccessIterator TimSortImpl::DetectRunAndMakeAscending(RandomAccessIterator
         return p;
     }
 
-    bool isAscending = *(p - 1) <= *p;
+    bool isAscending = comp(*p, *(p - 1)) == false;
 
     if (isAscending) {
         while (++p < last && comp(*p, *(p - 1)) == false) {};
     } else {
         while (++p < last && comp(*p, *(p - 1))) {};
         ReverseRun(first, p);
+
+        // A strictly descending run of length n has n * (n - 1) / 2 inversions.
+        uint64_t runLength = distance(first, p);
+        Hooks(comp).OnInversions(runLength * (runLength - 1) / 2);
+        Hooks(comp).OnMove(3 * (runLength / 2));
     }
+    Hooks(comp).OnRunDetected(first, p, isAscending == false);
 
     return p;
 }
@@ -291,15 +1257,21 @@ RandomAccessIterator TimSortImpl::DetectRunAndMakeAscending(RandomAccessIterator
 // 2. B > C
 template <typename RandomAccessIterator, typename Compare>
 inline void TimSortImpl::TryMerge(MergeState<RandomAccessIterator> &state, Compare comp)
+{
+    TryMerge(state, comp, NoReduce());
+}
+
+template <typename RandomAccessIterator, typename Compare, typename Reduce>
+inline void TimSortImpl::TryMerge(MergeState<RandomAccessIterator> &state, Compare comp, Reduce reduce)
 {
     while (state.mNumRunInStack > 1) {
         int32_t pos = state.mNumRunInStack - 2;
         if (pos > 0 && state.mStack[pos - 1].GetLength() <= state.mStack[pos].GetLength() + state.mStack[pos + 1].GetLength()) {
             // Choose the smaller one between A and C to merge with B.
             pos -= static_cast<size_t>(state.mStack[pos - 1].GetLength() < state.mStack[pos + 1].GetLength());
-            MergeAt(state, pos, comp);
-        } else if (state.mStack[pos].GetLength() <= state.mStack[pos].GetLength()) {
-            MergeAt(state, pos, comp);
+            MergeAt(state, pos, comp, reduce);
+        } else if (state.mStack[pos].GetLength() <= state.mStack[pos + 1].GetLength()) {
+            MergeAt(state, pos, comp, reduce);
         } else {
             // All rules are obeyed, do not need merge.
             break;
@@ -309,16 +1281,22 @@ inline void TimSortImpl::TryMerge(MergeState<RandomAccessIterator> &state, Compa
 
 template <typename RandomAccessIterator, typename Compare>
 inline void TimSortImpl::ForceMerge(MergeState<RandomAccessIterator> &state, Compare comp)
+{
+    ForceMerge(state, comp, NoReduce());
+}
+
+template <typename RandomAccessIterator, typename Compare, typename Reduce>
+inline void TimSortImpl::ForceMerge(MergeState<RandomAccessIterator> &state, Compare comp, Reduce reduce)
 {
     while (state.mNumRunInStack > 1) {
         int32_t pos = state.mNumRunInStack - 2;
 
         // Choose the smaller one between A and C to merge with B.
-        size_t length0 = distance(state.mStack[pos - 1].first, state.mStack[pos - 1].last);
-        size_t length1 = distance(state.mStack[pos + 1].first, state.mStack[pos + 1].last);
-        pos -= static_cast<size_t>(pos > 0 && length0 < length1);
+        if (pos > 0 && state.mStack[pos - 1].GetLength() < state.mStack[pos + 1].GetLength()) {
+            --pos;
+        }
 
-        MergeAt(state, pos, comp);
+        MergeAt(state, pos, comp, reduce);
     }
 }
 
@@ -343,6 +1321,7 @@ void TimSortImpl::MergeAt(MergeState<RandomAccessIterator> &state, size_t stackP
     RandomAccessIterator lastB = state.mStack[stackPos + 1].last;
     size_t lengthA = 0;
     size_t lengthB = 0;
+    Hooks(comp).OnMergeBegin(stackPos, firstA, firstB, lastB);
 
     // Adjust the stack entries
     state.mStack[stackPos].last = state.mStack[stackPos + 1].last;
@@ -357,6 +1336,7 @@ void TimSortImpl::MergeAt(MergeState<RandomAccessIterator> &state, size_t stackP
     RandomAccessIterator pA = GallopRight(firstA, lastA, firstA, *firstB, comp);
     lengthA = distance(pA, lastA);
     if (lengthA == 0) {
+        Hooks(comp).OnMergeEnd(firstA, lastB);
         return;
     }
 
@@ -365,6 +1345,7 @@ void TimSortImpl::MergeAt(MergeState<RandomAccessIterator> &state, size_t stackP
     RandomAccessIterator pB = GallopLeft(firstB, lastB, lastB - 1, *(lastA - 1), comp);
     lengthB = distance(firstB, pB);
     if (lengthB == 0) {
+        Hooks(comp).OnMergeEnd(firstA, lastB);
         return;
     }
 
@@ -373,25 +1354,107 @@ void TimSortImpl::MergeAt(MergeState<RandomAccessIterator> &state, size_t stackP
     } else {
         MergeHigh(state, pA, lastA, firstB, pB, comp);
     }
+    Hooks(comp).OnMergeEnd(firstA, lastB);
 }
 
-template <typename RandomAccessIterator, typename Compare>
-void TimSortImpl::MergeLow(
-        TimSortImpl::MergeState<RandomAccessIterator> &state, RandomAccessIterator firstA, RandomAccessIterator lastA,
-        RandomAccessIterator firstB, RandomAccessIterator lastB, Compare comp)
+template <typename RandomAccessIterator, typename Compare, typename Reduce>
+void TimSortImpl::MergeAt(MergeState<RandomAccessIterator> &state, size_t stackPos, Compare comp, Reduce reduce)
 {
-    // The number of left elems have not been merged yet. Init to the input two arrays' size.
-    typename RandomAccessIterator::difference_type lengthA = distance(firstA, lastA);
-    typename RandomAccessIterator::difference_type lengthB = distance(firstB, lastB);
-
-    assert(0 < lengthA && lengthA <= lengthB &&   // A must be smaller than B AND
-           lastA == firstB &&                     // A and B are adjacent AND
-           comp(*firstB, *firstA) &&              // first_elem_of_A > first_elem_of_B AND
-           comp(*(lastB - 1), *(lastA - 1)));     // last_elem_of_A > last_elem_of_B
-
-    state.EnsureMergeAreaSize(lengthA);
+    assert(stackPos == state.mNumRunInStack - 2 || stackPos == state.mNumRunInStack - 3);
 
-    // Copy the run A (the smaller one) into the temporary merge area
+    RandomAccessIterator firstA = state.mStack[stackPos].first;
+    RandomAccessIterator lastA = state.mStack[stackPos].last;
+    RandomAccessIterator firstB = state.mStack[stackPos + 1].first;
+    RandomAccessIterator lastB = state.mStack[stackPos + 1].last;
+    assert(lastA <= firstB);
+
+    if (stackPos == state.mNumRunInStack - 3) {
+        state.mStack[stackPos + 1] = state.mStack[stackPos + 2];
+    }
+    --state.mNumRunInStack;
+
+    // The elements of A less than the first element of B are already in place.
+    // An element equal to it is not, since it takes in the first element of B.
+    RandomAccessIterator cursorDest = GallopLeft(firstA, lastA, firstA, *firstB, comp);
+    size_t lengthA = distance(cursorDest, lastA);
+
+    GrowMergeArea(state, lengthA, comp);
+    std::copy(cursorDest, lastA, state.mMergeArea.begin());
+
+    // The destination never passes the cursor of B: it has received at most as many elements as A had
+    // plus the ones taken from B, and A ends before B begins.
+    RandomAccessIterator cursorA = state.mMergeArea.begin();
+    lastA = cursorA + lengthA;
+    RandomAccessIterator cursorB = firstB;
+    size_t minGallop = state.mMinGallop;
+    size_t countA = 0;  // The number of times in a row that A won
+    size_t countB = 0;  // The number of times in a row that B won
+
+    while (cursorA < lastA && cursorB < lastB) {
+        if (comp(*cursorB, *cursorA)) {
+            countA = 0;
+            if (++countB < minGallop) {
+                *cursorDest = *cursorB;
+                ++cursorDest;
+                ++cursorB;
+            } else {
+                RandomAccessIterator p = GallopLeft(cursorB, lastB, cursorB, *cursorA, comp);
+                cursorDest = std::copy(cursorB, p, cursorDest);
+                cursorB = p;
+                countB = 0;
+            }
+        } else if (comp(*cursorA, *cursorB)) {
+            countB = 0;
+            if (++countA < minGallop) {
+                *cursorDest = *cursorA;
+                ++cursorDest;
+                ++cursorA;
+            } else {
+                RandomAccessIterator p = GallopLeft(cursorA, lastA, cursorA, *cursorB, comp);
+                cursorDest = std::copy(cursorA, p, cursorDest);
+                cursorA = p;
+                countA = 0;
+            }
+        } else {
+            // A comes first in the input, so B is folded into it.
+            reduce(*cursorA, *cursorB);
+            *cursorDest = *cursorA;
+            ++cursorDest;
+            ++cursorA;
+            ++cursorB;
+            countA = 0;
+            countB = 0;
+        }
+    }
+
+    cursorDest = std::copy(cursorA, lastA, cursorDest);
+    if (cursorDest != cursorB) {
+        cursorDest = std::copy(cursorB, lastB, cursorDest);
+    } else {
+        cursorDest = lastB;
+    }
+
+    state.mStack[stackPos].last = cursorDest;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::MergeLow(
+        TimSortImpl::MergeState<RandomAccessIterator> &state, RandomAccessIterator firstA, RandomAccessIterator lastA,
+        RandomAccessIterator firstB, RandomAccessIterator lastB, Compare comp)
+{
+    // The number of left elems have not been merged yet. Init to the input two arrays' size.
+    typename RandomAccessIterator::difference_type lengthA = distance(firstA, lastA);
+    typename RandomAccessIterator::difference_type lengthB = distance(firstB, lastB);
+
+    assert(0 < lengthA && lengthA <= lengthB &&   // A must be smaller than B AND
+           lastA == firstB &&                     // A and B are adjacent AND
+           comp(*firstB, *firstA) &&              // first_elem_of_A > first_elem_of_B AND
+           comp(*(lastB - 1), *(lastA - 1)));     // last_elem_of_A > last_elem_of_B
+
+    GrowMergeArea(state, lengthA, comp);
+    Hooks(comp).OnMove(lengthA + lengthA + lengthB);
+
+    // Copy the run A (the smaller one) into the temporary merge area
     std::copy(firstA, lastA, state.mMergeArea.begin());
 
     RandomAccessIterator cursorA = state.mMergeArea.begin();  // point to the first of A, now in the merge area
@@ -399,6 +1462,10 @@ void TimSortImpl::MergeLow(
     RandomAccessIterator cursorB = firstB;                    // point to the first of B
     RandomAccessIterator cursorDest = firstA;                 // point to the dest area, i.e. the original A's position
 
+    // Each element of B taken before the rest of A makes an inversion with every element of that rest.
+    // Use local one for performance.
+    uint64_t numInversions = lengthA;
+
     // Move first element of run B in the dest area since caller guarantee that A[0] > B[0]
     *cursorDest = *cursorB;
     ++cursorDest;
@@ -407,6 +1474,7 @@ void TimSortImpl::MergeLow(
 
     // Use local one for performance.
     size_t minGallop = state.mMinGallop;
+    bool isGalloping = false;
 
     // Hanle degenerate case.
     // If now B is empty, this implies that A is also empty since lengthA <= lengthB
@@ -427,6 +1495,7 @@ void TimSortImpl::MergeLow(
         // one-pair-at-a-time mode
         do {
             if (comp(*cursorB, *cursorA)) {     // Current elem of B is less than current elem of A
+                numInversions += lengthA;
                 *cursorDest = *cursorB;
                 ++cursorDest;
                 ++cursorB;
@@ -452,6 +1521,11 @@ void TimSortImpl::MergeLow(
         } while ((countA | countB) < minGallop);  // if countA > 0 then countB == 0, vice versa
 
         // Switch to the galloping mode and continue galloping until neither run appears to be winning consistently any more.
+        // Each round in this mode lowers minGallop by one. Start one higher so that a single round leaves it unchanged
+        // and only the penalty on leaving counts, otherwise minGallop sinks to 1 on random data.
+        ++minGallop;
+        Hooks(comp).OnGallopEnter();
+        isGalloping = true;
         RandomAccessIterator p;
         do {
             assert(lengthA > 1 && lengthB > 0);
@@ -468,6 +1542,8 @@ void TimSortImpl::MergeLow(
                 if (lengthA == 0) {
                     // All B's elems must have been merged since the last element of A is greater than all elems of B.
                     assert(lengthB == 0);
+                    Hooks(comp).OnInversions(numInversions);
+                    Hooks(comp).OnGallopExit();
                     return;
                 }
 
@@ -475,6 +1551,7 @@ void TimSortImpl::MergeLow(
                     goto LABEL_COPY_B_TO_DEST_AND_APPEND_A;
                 }
             }
+            numInversions += lengthA;
             *cursorDest = *cursorB;
             ++cursorDest;
             ++cursorB;
@@ -486,6 +1563,7 @@ void TimSortImpl::MergeLow(
             p = GallopLeft(cursorB, lastB, cursorB, *cursorA, comp);
             countB = distance(cursorB, p);
             if (countB != 0) {
+                numInversions += static_cast<uint64_t>(countB) * lengthA;
                 std::copy(cursorB, p, cursorDest);
                 cursorDest += countB;
                 cursorB += countB;
@@ -511,17 +1589,28 @@ void TimSortImpl::MergeLow(
             minGallop -= (minGallop > 1);
         } while (countA >= kMinGallop || countB >= kMinGallop);
 
+        Hooks(comp).OnGallopExit();
+        isGalloping = false;
         ++minGallop;  // penalize for leaving gallop mode.
     } // end of while (1)
 
-    state.mMinGallop = minGallop;
-
 LABEL_COPY_MERGE_AREA_TO_DEST:
+    state.mMinGallop = minGallop;
+    if (isGalloping) {
+        Hooks(comp).OnGallopExit();
+    }
+    Hooks(comp).OnInversions(numInversions);
     assert(lengthA > 0 && lengthB == 0);
     std::copy(cursorA, cursorA + lengthA, cursorDest);
     return;
 
 LABEL_COPY_B_TO_DEST_AND_APPEND_A:
+    state.mMinGallop = minGallop;
+    if (isGalloping) {
+        Hooks(comp).OnGallopExit();
+    }
+    // The last element of A is greater than the rest of B.
+    Hooks(comp).OnInversions(numInversions + lengthB);
     assert(lengthA == 1 && lengthB > 0);
     std::copy(cursorB, cursorB + lengthB, cursorDest);
     cursorDest += lengthB;
@@ -543,7 +1632,8 @@ void TimSortImpl::MergeHigh(
            comp(*firstB, *firstA) &&              // first_elem_of_A > first_elem_of_B AND
            comp(*(lastB - 1), *(lastA - 1)));     // last_elem_of_A > last_elem_of_B
 
-    state.EnsureMergeAreaSize(lengthB);
+    GrowMergeArea(state, lengthB, comp);
+    Hooks(comp).OnMove(lengthB + lengthA + lengthB);
 
     // Copy run B to temprary array
     std::copy(firstB, lastB, state.mMergeArea.begin());
@@ -559,6 +1649,10 @@ void TimSortImpl::MergeHigh(
     RandomAccessIterator cursorB = state.mMergeArea.begin() + lengthB - 1;
     RandomAccessIterator cursorDest = lastB - 1;
 
+    // Each element of A taken after the rest of B makes an inversion with every element of that rest.
+    // Use local one for performance.
+    uint64_t numInversions = lengthB;
+
     // Move the last element of A and deal with degenerate 
     *cursorDest = *cursorA;
     --cursorDest;
@@ -567,6 +1661,7 @@ void TimSortImpl::MergeHigh(
 
     // Use local one for performance.
     size_t minGallop = state.mMinGallop;
+    bool isGalloping = false;
 
     if (lengthA == 0) {
         goto LABEL_COPY_MERGE_AREA_TO_DEST;
@@ -586,6 +1681,7 @@ void TimSortImpl::MergeHigh(
             assert(lengthA > 0 || lengthB > 1);
 
             if (comp(*cursorB, *cursorA)) {
+                numInversions += lengthB;
                 *cursorDest = *cursorA;
                 --cursorDest;
                 --cursorA;
@@ -611,6 +1707,11 @@ void TimSortImpl::MergeHigh(
         } while ((countA | countB) < minGallop);
 
         // Switch to the galloping mode and continue galloping until neither run appears to be winning consistently any more.
+        // Each round in this mode lowers minGallop by one. Start one higher so that a single round leaves it unchanged
+        // and only the penalty on leaving counts, otherwise minGallop sinks to 1 on random data.
+        ++minGallop;
+        Hooks(comp).OnGallopEnter();
+        isGalloping = true;
         RandomAccessIterator p;
         do {
             assert(lengthA > 0 && lengthB > 1);
@@ -619,6 +1720,7 @@ void TimSortImpl::MergeHigh(
             p = GallopRight(firstA, cursorA + 1, cursorA, *cursorB, comp);
             countA = distance(p, cursorA + 1);
             if (countA != 0) {
+                numInversions += static_cast<uint64_t>(countA) * lengthB;
                 std::copy_backward(p, cursorA + 1, cursorDest + 1);
                 cursorDest -= countA;
                 cursorA -= countA;
@@ -651,12 +1753,15 @@ void TimSortImpl::MergeHigh(
                 if (lengthB == 0) {
                     // A must be empty since firstA > firstB
                     assert(lengthA == 0);
+                    Hooks(comp).OnInversions(numInversions);
+                    Hooks(comp).OnGallopExit();
                     return;
                 }
                 if (lengthB == 1) {
                     goto LABEL_COPY_A_TO_DEST_AND_PREPEND_B;
                 }
             }
+            numInversions += lengthB;
             *cursorDest = *cursorA;
             --cursorDest;
             --cursorA;
@@ -672,17 +1777,28 @@ void TimSortImpl::MergeHigh(
             minGallop -= (minGallop > 1);
         } while (countA >= kMinGallop || countB >= kMinGallop);
 
+        Hooks(comp).OnGallopExit();
+        isGalloping = false;
         ++minGallop;  // penalize for leaving gallop mode.
     } // end of while (1)
 
-    state.mMinGallop = minGallop;
-
 LABEL_COPY_MERGE_AREA_TO_DEST:
+    state.mMinGallop = minGallop;
+    if (isGalloping) {
+        Hooks(comp).OnGallopExit();
+    }
+    Hooks(comp).OnInversions(numInversions);
     assert(lengthA == 0 && lengthB > 0);
     std::copy_backward(firstB, cursorB + 1, cursorDest + 1);
     return;
 
 LABEL_COPY_A_TO_DEST_AND_PREPEND_B:
+    state.mMinGallop = minGallop;
+    if (isGalloping) {
+        Hooks(comp).OnGallopExit();
+    }
+    // The first element of B is less than the rest of A.
+    Hooks(comp).OnInversions(numInversions + lengthA);
     assert(lengthB == 1 && lengthA > 0);
     std::copy_backward(firstA, cursorA + 1, cursorDest + 1);
     cursorDest -= lengthA;
@@ -690,10 +1806,10 @@ LABEL_COPY_A_TO_DEST_AND_PREPEND_B:
     return;
 }
 
-template <typename RandomAccessIterator, typename Compare>
+template <typename RandomAccessIterator, typename T, typename Compare>
 RandomAccessIterator TimSortImpl::GallopLeft(
         RandomAccessIterator first, RandomAccessIterator last, RandomAccessIterator hint,
-        const typename RandomAccessIterator::value_type &value, Compare comp)
+        const T &value, Compare comp)
 {
     assert(first <= hint && hint < last);
 
@@ -735,10 +1851,10 @@ RandomAccessIterator TimSortImpl::GallopLeft(
     return lower_bound(begin, end, value, comp);
 }
 
-template <typename RandomAccessIterator, typename Compare>
+template <typename RandomAccessIterator, typename T, typename Compare>
 RandomAccessIterator TimSortImpl::GallopRight(
         RandomAccessIterator first, RandomAccessIterator last, RandomAccessIterator hint,
-        const typename RandomAccessIterator::value_type &value, Compare comp)
+        const T &value, Compare comp)
 {
     assert(first <= hint && hint < last);
 
@@ -780,13 +1896,11 @@ RandomAccessIterator TimSortImpl::GallopRight(
 }
 
 template <typename RandomAccessIterator, typename Compare>
-void TimSortImpl::Sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+void TimSortImpl::PushRuns(MergeState<RandomAccessIterator> &state, RandomAccessIterator first, RandomAccessIterator last, Compare comp)
 {
-    assert(first <= last);
+    assert(first < last);
 
-    size_t numElems = distance(first, last);
-    size_t minRunLength = CalcMinRunLength(numElems);
-    MergeState<RandomAccessIterator> mergeState(numElems);
+    size_t minRunLength = CalcMinRunLength(distance(first, last));
 
     Run<RandomAccessIterator> run;
     RandomAccessIterator next = first;
@@ -796,42 +1910,1192 @@ void TimSortImpl::Sort(RandomAccessIterator first, RandomAccessIterator last, Co
         run.last = DetectRunAndMakeAscending(next, last, comp);
 
         size_t numRemainElems = distance(next, last);
-        size_t realRunLength = run.GetLength();
+        size_t naturalRunLength = run.GetLength();
+        size_t realRunLength = naturalRunLength;
         if (realRunLength < minRunLength && realRunLength < numRemainElems) {
             // OK, we need boost the run length and sort it by insertion sort.
             realRunLength = minRunLength < numRemainElems ? minRunLength : numRemainElems;
             run.last = run.first + realRunLength;
             assert(run.last <= last);
             BinaryInsertionSort(run.first, run.last, comp);
+            Hooks(comp).OnRunBoosted(run.first, run.first + naturalRunLength, run.last);
         }
 
         // Push the run to the stack
-        assert(mergeState.mNumRunInStack < kMaxMinRunLength);
-        mergeState.mStack[mergeState.mNumRunInStack++] = run;
+        assert(state.mNumRunInStack < kMaxMergeStackSize);
+        state.mStack[state.mNumRunInStack++] = run;
+        Hooks(comp).OnRunPushed(run.first, run.last, state.mNumRunInStack);
 
-        TryMerge(mergeState, comp);
+        TryMerge(state, comp);
 
         // move to the next range
         next = run.last;
     }
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::Sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+{
+    Hooks(comp).OnSortBegin(first, last);
+
+    if (SortFewDistinct(first, last, comp)) {
+        return;
+    }
+
+    SortRuns(first, last, comp);
+}
+
+template <typename RandomAccessIterator, typename Compare, typename HooksType>
+void TimSortImpl::Sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, HooksType &hooks)
+{
+    Sort(first, last, HookedCompare<Compare, HooksType>(comp, &hooks));
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::Sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, TimSortStats &stats)
+{
+    StatsHooks hooks(&stats);
+    Sort(first, last, comp, hooks);
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::SortTimed(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+{
+    PhaseHooks hooks(&ThreadPhaseTimes());
+    Sort(first, last, comp, hooks);
+}
+
+#define TIMSORT_COUNTABLE(T) \
+    template <> struct TimSortImpl::IsCountable<T, std::less<T> > { static const bool kValue = true; };
+
+TIMSORT_COUNTABLE(bool)
+TIMSORT_COUNTABLE(char)
+TIMSORT_COUNTABLE(signed char)
+TIMSORT_COUNTABLE(unsigned char)
+TIMSORT_COUNTABLE(short)
+TIMSORT_COUNTABLE(unsigned short)
+TIMSORT_COUNTABLE(int)
+TIMSORT_COUNTABLE(unsigned int)
+TIMSORT_COUNTABLE(long)
+TIMSORT_COUNTABLE(unsigned long)
+TIMSORT_COUNTABLE(long long)
+TIMSORT_COUNTABLE(unsigned long long)
+
+#undef TIMSORT_COUNTABLE
+
+// The instrumentation must not change the path taken.
+template <typename T, typename HooksType>
+struct TimSortImpl::IsCountable<T, TimSortImpl::HookedCompare<std::less<T>, HooksType> >
+{
+    static const bool kValue = IsCountable<T, std::less<T> >::kValue;
+};
+
+template <typename RandomAccessIterator, typename Compare>
+size_t TimSortImpl::FewDistinctTable<RandomAccessIterator, Compare>::Find(
+        const typename RandomAccessIterator::value_type &value)
+{
+    // Halve the range without branching on the comparison: the ids of random keys are not predictable.
+    size_t size = mSortedValues.size();
+    size_t low = 0;
+    while (size > 1) {
+        size_t half = size / 2;
+        low = mComp(mSortedValues[low + half - 1], value) ? low + half : low;
+        size -= half;
+    }
+    low += size == 1 && mComp(mSortedValues[low], value);
+
+    if (low < mSortedValues.size() && mComp(value, mSortedValues[low]) == false) {
+        return mSortedIds[low];
+    }
+
+    size_t id = mSortedIds.size();
+    if (id == kMaxFewDistinct) {
+        return kMaxFewDistinct;
+    }
+
+    mSortedValues.insert(mSortedValues.begin() + low, value);
+    mSortedIds.insert(mSortedIds.begin() + low, id);
+    return id;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+bool TimSortImpl::SortFewDistinct(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+{
+    size_t length = distance(first, last);
+    if (length < kMinFewDistinctLength) {
+        return false;
+    }
+
+    // Give up at once if the sample alone has too many distinct values.
+    // A sample in order hints at presorted input, which the runs sort with fewer comparisons than counting.
+    FewDistinctTable<RandomAccessIterator, Compare> table(comp);
+    size_t step = length / kFewDistinctSampleSize;
+    bool isSampleSorted = true;
+    for (RandomAccessIterator p = first; p < first + step * kFewDistinctSampleSize; p += step) {
+        if (table.Find(*p) == kMaxFewDistinct) {
+            return false;
+        }
+        if (p > first && comp(*p, *(p - step))) {
+            isSampleSorted = false;
+        }
+    }
+    if (isSampleSorted) {
+        return false;
+    }
+
+    typedef typename RandomAccessIterator::value_type ValueType;
+    return SortFewDistinct(first, last, table, BoolType<IsCountable<ValueType, Compare>::kValue>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+bool TimSortImpl::SortFewDistinct(
+        RandomAccessIterator first, RandomAccessIterator last, FewDistinctTable<RandomAccessIterator, Compare> &table,
+        BoolType<true>)
+{
+    // If the sampled keys span a small domain, look the keys up by their offset in it,
+    // and search the table only for the keys outside of it or met for the first time.
+    // The offsets are computed in uint64_t, where the subtraction wraps instead of overflowing.
+    uint64_t low = static_cast<uint64_t>(table.mSortedValues.front());
+    uint64_t domainSize = static_cast<uint64_t>(table.mSortedValues.back()) - low + 1;
+    std::vector<uint16_t> directIds(domainSize <= kMaxCountingDomain ? domainSize : 0, 0);  // 0 is unknown, else id + 1
+
+    std::vector<size_t> counts(kMaxFewDistinct, 0);
+    for (RandomAccessIterator p = first; p < last; ++p) {
+        uint64_t offset = static_cast<uint64_t>(*p) - low;
+        size_t id;
+        if (offset < directIds.size() && directIds[offset] != 0) {
+            id = directIds[offset] - 1;
+        } else {
+            id = table.Find(*p);
+            if (id == kMaxFewDistinct) {
+                return false;
+            }
+            if (offset < directIds.size()) {
+                directIds[offset] = static_cast<uint16_t>(id + 1);
+            }
+        }
+        ++counts[id];
+    }
+
+    Hooks(table.mComp).OnMove(distance(first, last));
+    for (size_t i = 0; i < table.mSortedIds.size(); ++i) {
+        size_t count = counts[table.mSortedIds[i]];
+        std::fill(first, first + count, table.mSortedValues[i]);
+        first += count;
+    }
+
+    Hooks(table.mComp).OnSortEnd(kMinGallop);
+    return true;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+bool TimSortImpl::SortFewDistinct(
+        RandomAccessIterator first, RandomAccessIterator last, FewDistinctTable<RandomAccessIterator, Compare> &table,
+        BoolType<false>)
+{
+    // Nothing is moved while classifying. A value beyond the limit ends the grouped prefix there.
+    RandomAccessIterator classifiedLast = first;
+    std::vector<uint8_t> ids;
+    ids.reserve(distance(first, last));
+    for (; classifiedLast < last; ++classifiedLast) {
+        size_t id = table.Find(*classifiedLast);
+        if (id == kMaxFewDistinct) {
+            break;
+        }
+        ids.push_back(static_cast<uint8_t>(id));
+    }
+
+    // The halves A = [first, middle) and B = [middle, classifiedLast) are counted apart for the scatter.
+    size_t length = ids.size();
+    size_t half = length / 2;
+    RandomAccessIterator middle = first + half;
+    std::vector<size_t> countsA(kMaxFewDistinct, 0);
+    std::vector<size_t> countsB(kMaxFewDistinct, 0);
+    for (size_t i = 0; i < length; ++i) {
+        ++(i < half ? countsA : countsB)[ids[i]];
+    }
+
+    // The first position of each id in the grouped A and in the grouped B, in sorted order.
+    std::vector<size_t> startA(kMaxFewDistinct, 0);
+    std::vector<size_t> startB(kMaxFewDistinct, 0);
+    size_t positionA = 0;
+    size_t positionB = 0;
+    for (size_t i = 0; i < table.mSortedIds.size(); ++i) {
+        size_t id = table.mSortedIds[i];
+        startA[id] = positionA;
+        positionA += countsA[id];
+        startB[id] = positionB;
+        positionB += countsB[id];
+    }
+
+    // Group B in place through the buffer, then group A into the buffer. Each group keeps the input order.
+    std::vector<typename RandomAccessIterator::value_type> buffer(middle, classifiedLast);
+    std::vector<size_t> next(startB);
+    for (size_t i = 0; i < buffer.size(); ++i) {
+        middle[next[ids[half + i]]++] = buffer[i];
+    }
+    next = startA;
+    for (size_t i = 0; i < half; ++i) {
+        buffer[next[ids[i]]++] = first[i];
+    }
+
+    // Lay out the groups in sorted order, the elements of A before those of B, so the sort is stable.
+    // The destination never passes the group of B it moves next, since only the half elements of A come extra.
+    RandomAccessIterator dest = first;
+    for (size_t i = 0; i < table.mSortedIds.size(); ++i) {
+        size_t id = table.mSortedIds[i];
+        dest = std::copy(buffer.begin() + startA[id], buffer.begin() + startA[id] + countsA[id], dest);
+        RandomAccessIterator groupB = middle + startB[id];
+        if (dest != groupB) {
+            std::copy(groupB, groupB + countsB[id], dest);
+        }
+        dest += countsB[id];
+    }
+    Hooks(table.mComp).OnMove(2 * length + (length - half));
+
+    // The classification is not wasted when it gives up late: the grouped prefix is the first run of the rest.
+    Hooks(table.mComp).OnSortEnd(SortAppended(first, classifiedLast, last, table.mComp));
+    return true;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::SortRuns(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+{
+    assert(first <= last);
+
+    if (first == last) {
+        Hooks(comp).OnSortEnd(kMinGallop);
+        return;
+    }
+
+    MergeState<RandomAccessIterator> mergeState(distance(first, last));
+    Hooks(comp).OnMergeAreaGrow(mergeState.mMergeArea.capacity() * sizeof(typename RandomAccessIterator::value_type));
+
+    PushRuns(mergeState, first, last, comp);
 
     // Force merging all runs left in the stack
     if (mergeState.mNumRunInStack != 0) {
         ForceMerge(mergeState, comp);
     }
+
+    Hooks(comp).OnSortEnd(mergeState.mMinGallop);
 }
 
-template <typename RandomAccessIterator>
-inline void TimSort(RandomAccessIterator first, RandomAccessIterator last)
+template <typename RandomAccessIterator, typename Compare>
+uint64_t TimSortImpl::CountInversions(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
 {
-    TimSort(first, last, std::less<typename RandomAccessIterator::value_type>());
+    // The low cardinality path does not count inversions, so the runs sort all inputs here.
+    InversionHooks hooks;
+    SortRuns(first, last, HookedCompare<Compare, InversionHooks>(comp, &hooks));
+    return hooks.mNumInversions;
 }
 
 template <typename RandomAccessIterator, typename Compare>
-inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, Compare compare)
+size_t TimSortImpl::SortAppended(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp)
 {
-    TimSortImpl ts;
-    ts.Sort(first, last, compare);
+    assert(first <= middle && middle <= last);
+
+    if (middle == last) {
+        return kMinGallop;
+    }
+
+    MergeState<RandomAccessIterator> mergeState(distance(first, last));
+    Hooks(comp).OnMergeAreaGrow(mergeState.mMergeArea.capacity() * sizeof(typename RandomAccessIterator::value_type));
+
+    // The sorted prefix is the bottom run of the stack. It is the longest run in the common case,
+    // so the stack invariants keep it there until the tail runs are merged into one.
+    if (first < middle) {
+        Run<RandomAccessIterator> prefix;
+        prefix.first = first;
+        prefix.last = middle;
+        mergeState.mStack[mergeState.mNumRunInStack++] = prefix;
+        Hooks(comp).OnRunDetected(first, middle, false);
+        Hooks(comp).OnRunPushed(first, middle, mergeState.mNumRunInStack);
+    }
+
+    PushRuns(mergeState, middle, last, comp);
+
+    ForceMerge(mergeState, comp);
+    return mergeState.mMinGallop;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+bool TimSortImpl::SortBounded(RandomAccessIterator first, RandomAccessIterator last, size_t k, Compare comp)
+{
+    assert(first <= last);
+
+    size_t length = distance(first, last);
+    if (k >= length) {
+        Sort(first, last, comp);
+        return true;
+    }
+
+    if (k <= kMaxLinearInsertionBound) {
+        RandomAccessIterator p = BoundedInsertionSort(first, last, 2 * k, comp);
+        if (p < last) {
+            SortAppended(first, p, last, comp);
+            return false;
+        }
+        return true;
+    }
+
+    // One merge state for all chunks, so that the merge area is allocated once.
+    MergeState<RandomAccessIterator> state(length);
+    size_t chunkLength = std::max<size_t>(k, 1);
+
+    // [first, pending) is final, [pending, chunkFirst) is sorted but its elements may still move.
+    RandomAccessIterator pending = first;
+    for (RandomAccessIterator chunkFirst = first; chunkFirst < last; ) {
+        RandomAccessIterator chunkLast = chunkFirst + std::min<size_t>(chunkLength, distance(chunkFirst, last));
+
+        state.mNumRunInStack = 0;
+        if (pending < chunkFirst) {
+            Run<RandomAccessIterator> run;
+            run.first = pending;
+            run.last = chunkFirst;
+            state.mStack[state.mNumRunInStack++] = run;
+        }
+        PushRuns(state, chunkFirst, chunkLast, comp);
+        ForceMerge(state, comp);
+
+        // The smallest element that may still move must not be less than the final ones.
+        if (pending > first && comp(*pending, *(pending - 1))) {
+            SortAppended(first, pending, last, comp);
+            return false;
+        }
+
+        // An element k places after position p cannot belong before p, so all but the last k elements are final.
+        if (static_cast<size_t>(distance(pending, chunkLast)) > k) {
+            pending = chunkLast - k;
+        }
+        chunkFirst = chunkLast;
+    }
+
+    return true;
+}
+
+template <typename RandomAccessIterator, typename Compare, typename Reduce>
+RandomAccessIterator TimSortImpl::ReduceRun(RandomAccessIterator first, RandomAccessIterator last, Compare comp, Reduce reduce)
+{
+    if (first == last) {
+        return last;
+    }
+
+    RandomAccessIterator kept = first;
+    for (RandomAccessIterator next = first + 1; next < last; ++next) {
+        if (comp(*kept, *next)) {
+            ++kept;
+            if (kept != next) {
+                *kept = *next;
+            }
+        } else {
+            reduce(*kept, *next);
+        }
+    }
+
+    return kept + 1;
+}
+
+template <typename RandomAccessIterator, typename Compare, typename Reduce>
+RandomAccessIterator TimSortImpl::SortReduce(RandomAccessIterator first, RandomAccessIterator last, Compare comp, Reduce reduce)
+{
+    assert(first <= last);
+
+    if (first == last) {
+        return last;
+    }
+
+    MergeState<RandomAccessIterator> state(distance(first, last));
+    size_t minRunLength = CalcMinRunLength(distance(first, last));
+
+    // As PushRuns, but each run is reduced before it is pushed. The runs in the stack are then separated
+    // by the gaps of the dropped elements, which the merges fill up from the left.
+    Run<RandomAccessIterator> run;
+    RandomAccessIterator next = first;
+    while (next < last) {
+        run.first = next;
+        run.last = DetectRunAndMakeAscending(next, last, comp);
+
+        size_t numRemainElems = distance(next, last);
+        size_t realRunLength = run.GetLength();
+        if (realRunLength < minRunLength && realRunLength < numRemainElems) {
+            realRunLength = minRunLength < numRemainElems ? minRunLength : numRemainElems;
+            run.last = run.first + realRunLength;
+            BinaryInsertionSort(run.first, run.last, comp);
+        }
+
+        next = run.last;
+        run.last = ReduceRun(run.first, run.last, comp, reduce);
+
+        assert(state.mNumRunInStack < kMaxMergeStackSize);
+        state.mStack[state.mNumRunInStack++] = run;
+
+        TryMerge(state, comp, reduce);
+    }
+
+    ForceMerge(state, comp, reduce);
+
+    assert(state.mNumRunInStack == 1 && state.mStack[0].first == first);
+    return state.mStack[0].last;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::MergeIntoTopK(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp)
+{
+    assert(first < middle && middle <= last);
+
+    Sort(middle, last, comp);
+    Merge(first, middle, last, comp);
 }
 
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::PartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp)
+{
+    assert(first <= middle && middle <= last);
+
+    if (first == middle) {
+        return;
+    }
+
+    Sort(first, middle, comp);
+
+    // The candidates are gathered in input order in [middle, batchLast), and merged into the buffer k at a time,
+    // so that each one costs O(log k) instead of a merge over the buffer.
+    size_t k = distance(first, middle);
+    RandomAccessIterator batchLast = middle;
+    RandomAccessIterator next = middle;
+    while (next < last) {
+        // Only the elements less than the largest buffered one can enter the buffer. An equal element can not,
+        // since the buffered one comes first in the input. Most elements fail this test once the buffer is warm.
+        if (comp(*next, *(middle - 1)) == false) {
+            ++next;
+            continue;
+        }
+
+        // Take the run starting at the candidate. Its candidates are a prefix, the rest is skipped in one gallop.
+        // A prefix longer than the room left in the batch is cut, and the rest of the run is checked again after
+        // the batch is merged.
+        RandomAccessIterator runFirst = next;
+        RandomAccessIterator runLast = DetectRunAndMakeAscending(next, last, comp);
+        RandomAccessIterator p = GallopLeft(runFirst, runLast, runFirst, *(middle - 1), comp);
+        size_t room = k - distance(middle, batchLast);
+        next = runLast;
+        if (static_cast<size_t>(distance(runFirst, p)) >= room) {
+            p = runFirst + room;
+            next = p;
+        }
+
+        // Move the candidates to the end of the batch. The elements passed over since are not candidates,
+        // their order does not matter.
+        size_t length = distance(runFirst, p);
+        if (static_cast<size_t>(distance(batchLast, runFirst)) >= length) {
+            std::swap_ranges(runFirst, p, batchLast);
+        } else {
+            std::rotate(batchLast, runFirst, p);
+        }
+        batchLast += length;
+
+        if (batchLast == middle + k) {
+            MergeIntoTopK(first, middle, batchLast, comp);
+            batchLast = middle;
+        }
+    }
+
+    if (batchLast > middle) {
+        MergeIntoTopK(first, middle, batchLast, comp);
+    }
+}
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::TopK(RandomAccessIterator first, RandomAccessIterator last, size_t k, OutputIterator out, Compare comp)
+{
+    assert(first <= last);
+
+    k = std::min<size_t>(k, distance(first, last));
+    if (k == 0) {
+        return out;
+    }
+
+    // The k-buffer, followed by a batch of up to k candidates as in PartialSort.
+    std::vector<typename RandomAccessIterator::value_type> buffer;
+    buffer.reserve(2 * k);
+    buffer.assign(first, first + k);
+    Sort(buffer.begin(), buffer.end(), comp);
+
+    RandomAccessIterator next = first + k;
+    while (next < last) {
+        if (comp(*next, buffer[k - 1]) == false) {
+            ++next;
+            continue;
+        }
+
+        // The input is read only, so only the non-descending run starting at the candidate is used.
+        RandomAccessIterator runFirst = next;
+        while (++next < last && comp(*next, *(next - 1)) == false) {};
+        RandomAccessIterator p = GallopLeft(runFirst, next, runFirst, buffer[k - 1], comp);
+        size_t room = 2 * k - buffer.size();
+        if (static_cast<size_t>(distance(runFirst, p)) >= room) {
+            p = runFirst + room;
+            next = p;
+        }
+        buffer.insert(buffer.end(), runFirst, p);
+
+        if (buffer.size() == 2 * k) {
+            MergeIntoTopK(buffer.begin(), buffer.begin() + k, buffer.end(), comp);
+            buffer.resize(k);
+        }
+    }
+
+    if (buffer.size() > k) {
+        MergeIntoTopK(buffer.begin(), buffer.begin() + k, buffer.end(), comp);
+    }
+
+    return std::copy(buffer.begin(), buffer.begin() + k, out);
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::Merge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare comp)
+{
+    assert(first <= middle && middle <= last);
+
+    if (first == middle || middle == last) {
+        return;
+    }
+
+    MergeState<RandomAccessIterator> mergeState(distance(first, last));
+    mergeState.mStack[0].first = first;
+    mergeState.mStack[0].last = middle;
+    mergeState.mStack[1].first = middle;
+    mergeState.mStack[1].last = last;
+    mergeState.mNumRunInStack = 2;
+
+    MergeAt(mergeState, 0, comp);
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::MergeTo(
+        RandomAccessIterator1 firstA, RandomAccessIterator1 lastA, RandomAccessIterator2 firstB, RandomAccessIterator2 lastB,
+        OutputIterator out, Compare comp)
+{
+    assert(firstA <= lastA && firstB <= lastB);
+
+    if (firstA == lastA || firstB == lastB) {
+        out = std::copy(firstA, lastA, out);
+        return std::copy(firstB, lastB, out);
+    }
+
+    // The elements of A not greater than the first element of B go first.
+    RandomAccessIterator1 pA = GallopRight(firstA, lastA, firstA, *firstB, comp);
+    out = std::copy(firstA, pA, out);
+    firstA = pA;
+    if (firstA == lastA) {
+        return std::copy(firstB, lastB, out);
+    }
+
+    // The elements of B not less than the last element of A go last.
+    RandomAccessIterator2 tailB = GallopLeft(firstB, lastB, lastB - 1, *(lastA - 1), comp);
+
+    size_t minGallop = kMinGallop;
+    while (firstA < lastA && firstB < tailB) {
+        // Do the straitforward merging until one run wins consistently.
+        size_t countA = 0;
+        size_t countB = 0;
+
+        // one-pair-at-a-time mode
+        do {
+            if (comp(*firstB, *firstA)) {
+                *out = *firstB;
+                ++out;
+                ++firstB;
+                countA = 0;
+                ++countB;
+            } else {
+                *out = *firstA;
+                ++out;
+                ++firstA;
+                ++countA;
+                countB = 0;
+            }
+        } while (firstA < lastA && firstB < tailB && (countA | countB) < minGallop);
+
+        // Switch to the galloping mode and continue galloping until neither run appears to be winning consistently any more.
+        ++minGallop;
+        while (firstA < lastA && firstB < tailB) {
+            minGallop -= (minGallop > 1);
+
+            RandomAccessIterator1 p = GallopRight(firstA, lastA, firstA, *firstB, comp);
+            countA = distance(firstA, p);
+            out = std::copy(firstA, p, out);
+            firstA = p;
+            if (firstA == lastA) {
+                break;
+            }
+
+            RandomAccessIterator2 q = GallopLeft(firstB, tailB, firstB, *firstA, comp);
+            countB = distance(firstB, q);
+            out = std::copy(firstB, q, out);
+            firstB = q;
+
+            if (countA < kMinGallop && countB < kMinGallop) {
+                break;
+            }
+        }
+
+        ++minGallop;  // penalize for leaving gallop mode.
+    }
+
+    out = std::copy(firstA, lastA, out);
+    return std::copy(firstB, lastB, out);
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::SetIntersection(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare comp)
+{
+    // The cursor of each range is the hint of its next search, so each gallop only covers the gap to the next match.
+    while (first1 < last1 && first2 < last2) {
+        if (comp(*first1, *first2)) {
+            first1 = GallopLeft(first1, last1, first1, *first2, comp);
+        } else if (comp(*first2, *first1)) {
+            first2 = GallopLeft(first2, last2, first2, *first1, comp);
+        } else {
+            *out = *first1;
+            ++out;
+            ++first1;
+            ++first2;
+        }
+    }
+
+    return out;
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::SetUnion(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare comp)
+{
+    while (first1 < last1 && first2 < last2) {
+        if (comp(*first1, *first2)) {
+            RandomAccessIterator1 p = GallopLeft(first1, last1, first1, *first2, comp);
+            out = std::copy(first1, p, out);
+            first1 = p;
+        } else if (comp(*first2, *first1)) {
+            RandomAccessIterator2 p = GallopLeft(first2, last2, first2, *first1, comp);
+            out = std::copy(first2, p, out);
+            first2 = p;
+        } else {
+            *out = *first1;
+            ++out;
+            ++first1;
+            ++first2;
+        }
+    }
+
+    out = std::copy(first1, last1, out);
+    return std::copy(first2, last2, out);
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::SetDifference(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare comp)
+{
+    while (first1 < last1 && first2 < last2) {
+        if (comp(*first1, *first2)) {
+            RandomAccessIterator1 p = GallopLeft(first1, last1, first1, *first2, comp);
+            out = std::copy(first1, p, out);
+            first1 = p;
+        } else if (comp(*first2, *first1)) {
+            first2 = GallopLeft(first2, last2, first2, *first1, comp);
+        } else {
+            ++first1;
+            ++first2;
+        }
+    }
+
+    return std::copy(first1, last1, out);
+}
+
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::FingerSearch(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out, bool isUpperBound, Compare comp)
+{
+    assert(first <= last);
+
+    if (first == last) {
+        for (; needleFirst != needleLast; ++needleFirst) {
+            *out = first;
+            ++out;
+        }
+        return out;
+    }
+
+    RandomAccessIterator hint = first;
+    for (; needleFirst != needleLast; ++needleFirst) {
+        RandomAccessIterator result = isUpperBound ?
+            GallopRight(first, last, hint, *needleFirst, comp) : GallopLeft(first, last, hint, *needleFirst, comp);
+        *out = result;
+        ++out;
+
+        // The hint must point to an element. Past the end, start from the last one.
+        hint = result < last ? result : last - 1;
+    }
+
+    return out;
+}
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::SetIntersectionK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+        Compare comp)
+{
+    size_t numRanges = ranges.size();
+    if (numRanges == 0) {
+        return out;
+    }
+
+    std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > cursors(ranges);
+    for (size_t i = 0; i < numRanges; ++i) {
+        if (cursors[i].first == cursors[i].second) {
+            return out;
+        }
+    }
+
+    RandomAccessIterator candidate = cursors[0].first;
+    size_t numMatched = 1;  // number of ranges whose head is equal to the candidate
+    size_t i = 1 % numRanges;
+    while (1) {
+        if (numMatched == numRanges) {
+            *out = *cursors[0].first;
+            ++out;
+            for (size_t j = 0; j < numRanges; ++j) {
+                if (++cursors[j].first == cursors[j].second) {
+                    return out;
+                }
+            }
+            candidate = cursors[0].first;
+            numMatched = 1;
+            i = 1 % numRanges;
+            continue;
+        }
+
+        std::pair<RandomAccessIterator, RandomAccessIterator> &cursor = cursors[i];
+        cursor.first = GallopLeft(cursor.first, cursor.second, cursor.first, *candidate, comp);
+        if (cursor.first == cursor.second) {
+            return out;
+        }
+
+        if (comp(*candidate, *cursor.first)) {
+            candidate = cursor.first;
+            numMatched = 1;
+        } else {
+            ++numMatched;
+        }
+        i = (i + 1) % numRanges;
+    }
+}
+
+template <typename RandomAccessIterator, typename Compare>
+TimSortImpl::LoserTree<RandomAccessIterator, Compare>::LoserTree(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, Compare comp)
+    : mNumRanges(ranges.size()), mRanges(ranges), mTree(ranges.size()), mComp(comp)
+{
+    assert(mNumRanges > 0);
+
+    // Play the tournament bottom up. winners[n] is the winner of the subtree at node n.
+    std::vector<size_t> winners(2 * mNumRanges);
+    for (size_t i = 0; i < mNumRanges; ++i) {
+        winners[mNumRanges + i] = i;
+    }
+    for (size_t node = mNumRanges - 1; node > 0; --node) {
+        size_t a = winners[2 * node];
+        size_t b = winners[2 * node + 1];
+        if (Beats(a, b)) {
+            winners[node] = a;
+            mTree[node] = b;
+        } else {
+            winners[node] = b;
+            mTree[node] = a;
+        }
+    }
+    mTree[0] = mNumRanges > 1 ? winners[1] : 0;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+void TimSortImpl::LoserTree<RandomAccessIterator, Compare>::Replay()
+{
+    size_t winner = mTree[0];
+    for (size_t node = (winner + mNumRanges) / 2; node > 0; node /= 2) {
+        if (Beats(mTree[node], winner)) {
+            std::swap(mTree[node], winner);
+        }
+    }
+    mTree[0] = winner;
+}
+
+template <typename RandomAccessIterator, typename Compare>
+size_t TimSortImpl::LoserTree<RandomAccessIterator, Compare>::RunnerUp() const
+{
+    // The runner-up lost its last match to the winner, so it is one of the losers on the winner's path.
+    size_t runnerUp = mNumRanges;
+    for (size_t node = (mTree[0] + mNumRanges) / 2; node > 0; node /= 2) {
+        size_t loser = mTree[node];
+        if (mRanges[loser].first != mRanges[loser].second && (runnerUp == mNumRanges || Beats(loser, runnerUp))) {
+            runnerUp = loser;
+        }
+    }
+    return runnerUp;
+}
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+OutputIterator TimSortImpl::MergeK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+        Compare comp)
+{
+    if (ranges.empty()) {
+        return out;
+    }
+
+    LoserTree<RandomAccessIterator, Compare> tree(ranges, comp);
+    size_t minGallop = kMinGallop;
+    size_t lastWinner = tree.mNumRanges;
+    size_t count = 0;   // number of times in a row lastWinner won
+
+    while (tree.IsEmpty() == false) {
+        // one-element-at-a-time mode
+        size_t winner = tree.Winner();
+        if (winner == lastWinner) {
+            ++count;
+        } else {
+            lastWinner = winner;
+            count = 1;
+        }
+
+        if (count < minGallop) {
+            *out = *tree.mRanges[winner].first;
+            ++out;
+            ++tree.mRanges[winner].first;
+            tree.Replay();
+            continue;
+        }
+
+        // Galloping mode: copy the whole block of the winner that is ordered before the head of the runner-up.
+        // Stay in this mode while the blocks are long.
+        size_t numCopied;
+        ++minGallop;
+        do {
+            winner = tree.Winner();
+            RandomAccessIterator cursor = tree.mRanges[winner].first;
+            RandomAccessIterator last = tree.mRanges[winner].second;
+            RandomAccessIterator p = last;
+
+            size_t runnerUp = tree.RunnerUp();
+            if (runnerUp != tree.mNumRanges) {
+                // Equal elements stay in the winner's block only if the winner comes first.
+                if (winner < runnerUp) {
+                    p = GallopRight(cursor, last, cursor, *tree.mRanges[runnerUp].first, comp);
+                } else {
+                    p = GallopLeft(cursor, last, cursor, *tree.mRanges[runnerUp].first, comp);
+                }
+            }
+            assert(p > cursor);
+
+            out = std::copy(cursor, p, out);
+            numCopied = distance(cursor, p);
+            tree.mRanges[winner].first = p;
+            tree.Replay();
+
+            minGallop -= (minGallop > 1);
+        } while (numCopied >= kMinGallop && tree.IsEmpty() == false);
+
+        ++minGallop;  // penalize for leaving gallop mode.
+        lastWinner = tree.mNumRanges;
+        count = 0;
+    }
+
+    return out;
+}
+
+template <typename RandomAccessIterator>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last)
+{
+    TimSort(first, last, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, Compare compare)
+{
+    TimSortImpl ts;
+    ts.Sort(first, last, compare);
+}
+
+template <typename RandomAccessIterator>
+inline uint64_t TimSortCountInversions(RandomAccessIterator first, RandomAccessIterator last)
+{
+    return TimSortCountInversions(first, last, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline uint64_t TimSortCountInversions(RandomAccessIterator first, RandomAccessIterator last, Compare compare)
+{
+    return TimSortImpl::CountInversions(first, last, compare);
+}
+
+template <typename RandomAccessIterator>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, TimSortStats &stats)
+{
+    TimSort(first, last, std::less<typename RandomAccessIterator::value_type>(), stats);
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, Compare compare, TimSortStats &stats)
+{
+    TimSortImpl::Sort(first, last, compare, stats);
+}
+
+template <typename RandomAccessIterator, typename Compare, typename HooksType>
+inline void TimSort(RandomAccessIterator first, RandomAccessIterator last, Compare compare, HooksType &hooks)
+{
+    TimSortImpl::Sort(first, last, compare, hooks);
+}
+
+template <typename RandomAccessIterator>
+inline void TimSortTimed(RandomAccessIterator first, RandomAccessIterator last)
+{
+    TimSortTimed(first, last, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimSortTimed(RandomAccessIterator first, RandomAccessIterator last, Compare compare)
+{
+    TimSortImpl::SortTimed(first, last, compare);
+}
+
+inline const TimSortPhaseTimes &TimSortGetPhaseTimes()
+{
+    // The thread local times start zeroed rather than cleared, so their unit is set here.
+    TimSortPhaseTimes &times = TimSortImpl::ThreadPhaseTimes();
+    times.mTickUnit = TimSortPhaseTimes::GetPlatformTickUnit();
+    return times;
+}
+
+inline void TimSortClearPhaseTimes()
+{
+    TimSortImpl::ThreadPhaseTimes().Clear();
+}
+
+template <typename RandomAccessIterator>
+inline void TimSortAppend(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last)
+{
+    TimSortAppend(first, middle, last, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimSortAppend(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare compare)
+{
+    TimSortImpl::SortAppended(first, middle, last, compare);
+}
+
+template <typename RandomAccessIterator>
+inline bool TimSortBounded(RandomAccessIterator first, RandomAccessIterator last, size_t k)
+{
+    return TimSortBounded(first, last, k, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline bool TimSortBounded(RandomAccessIterator first, RandomAccessIterator last, size_t k, Compare compare)
+{
+    return TimSortImpl::SortBounded(first, last, k, compare);
+}
+
+template <typename RandomAccessIterator>
+inline RandomAccessIterator TimSortUnique(RandomAccessIterator first, RandomAccessIterator last, TimUniquePolicy policy)
+{
+    return TimSortUnique(first, last, std::less<typename RandomAccessIterator::value_type>(), policy);
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline RandomAccessIterator TimSortUnique(
+        RandomAccessIterator first, RandomAccessIterator last, Compare compare, TimUniquePolicy policy)
+{
+    if (policy == kTimKeepLast) {
+        return TimSortImpl::SortReduce(first, last, compare, TimSortImpl::KeepLast());
+    }
+    return TimSortImpl::SortReduce(first, last, compare, TimSortImpl::KeepFirst());
+}
+
+template <typename RandomAccessIterator, typename Compare, typename Reduce>
+inline RandomAccessIterator TimSortReduce(
+        RandomAccessIterator first, RandomAccessIterator last, Compare compare, Reduce reduce)
+{
+    return TimSortImpl::SortReduce(first, last, compare, reduce);
+}
+
+template <typename RandomAccessIterator>
+inline void TimPartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last)
+{
+    TimPartialSort(first, middle, last, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimPartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare compare)
+{
+    TimSortImpl::PartialSort(first, middle, last, compare);
+}
+
+template <typename RandomAccessIterator, typename OutputIterator>
+inline OutputIterator TimTopK(RandomAccessIterator first, RandomAccessIterator last, size_t k, OutputIterator out)
+{
+    return TimTopK(first, last, k, out, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimTopK(RandomAccessIterator first, RandomAccessIterator last, size_t k, OutputIterator out, Compare compare)
+{
+    return TimSortImpl::TopK(first, last, k, out, compare);
+}
+
+template <typename RandomAccessIterator, typename OutputIterator>
+inline OutputIterator TimMergeK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out)
+{
+    return TimMergeK(ranges, out, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimMergeK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+        Compare compare)
+{
+    return TimSortImpl::MergeK(ranges, out, compare);
+}
+
+template <typename RandomAccessIterator>
+inline void TimMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last)
+{
+    TimMerge(first, middle, last, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename Compare>
+inline void TimMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Compare compare)
+{
+    TimSortImpl::Merge(first, middle, last, compare);
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimMerge(
+        RandomAccessIterator1 firstA, RandomAccessIterator1 lastA, RandomAccessIterator2 firstB, RandomAccessIterator2 lastB,
+        OutputIterator out)
+{
+    return TimMerge(firstA, lastA, firstB, lastB, out, std::less<typename RandomAccessIterator1::value_type>());
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimMerge(
+        RandomAccessIterator1 firstA, RandomAccessIterator1 lastA, RandomAccessIterator2 firstB, RandomAccessIterator2 lastB,
+        OutputIterator out, Compare compare)
+{
+    return TimSortImpl::MergeTo(firstA, lastA, firstB, lastB, out, compare);
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimSetIntersection(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out)
+{
+    return TimSetIntersection(first1, last1, first2, last2, out, std::less<typename RandomAccessIterator1::value_type>());
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetIntersection(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare compare)
+{
+    return TimSortImpl::SetIntersection(first1, last1, first2, last2, out, compare);
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimSetUnion(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out)
+{
+    return TimSetUnion(first1, last1, first2, last2, out, std::less<typename RandomAccessIterator1::value_type>());
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetUnion(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare compare)
+{
+    return TimSortImpl::SetUnion(first1, last1, first2, last2, out, compare);
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator>
+inline OutputIterator TimSetDifference(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out)
+{
+    return TimSetDifference(first1, last1, first2, last2, out, std::less<typename RandomAccessIterator1::value_type>());
+}
+
+template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetDifference(
+        RandomAccessIterator1 first1, RandomAccessIterator1 last1, RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+        OutputIterator out, Compare compare)
+{
+    return TimSortImpl::SetDifference(first1, last1, first2, last2, out, compare);
+}
+
+template <typename RandomAccessIterator, typename OutputIterator>
+inline OutputIterator TimSetIntersectionK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out)
+{
+    return TimSetIntersectionK(ranges, out, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimSetIntersectionK(
+        const std::vector<std::pair<RandomAccessIterator, RandomAccessIterator> > &ranges, OutputIterator out,
+        Compare compare)
+{
+    return TimSortImpl::SetIntersectionK(ranges, out, compare);
+}
+
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator>
+inline OutputIterator TimLowerBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out)
+{
+    return TimLowerBounds(first, last, needleFirst, needleLast, out, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimLowerBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out, Compare compare)
+{
+    return TimSortImpl::FingerSearch(first, last, needleFirst, needleLast, out, false, compare);
+}
+
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator>
+inline OutputIterator TimUpperBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out)
+{
+    return TimUpperBounds(first, last, needleFirst, needleLast, out, std::less<typename RandomAccessIterator::value_type>());
+}
+
+template <typename RandomAccessIterator, typename InputIterator, typename OutputIterator, typename Compare>
+inline OutputIterator TimUpperBounds(
+        RandomAccessIterator first, RandomAccessIterator last, InputIterator needleFirst, InputIterator needleLast,
+        OutputIterator out, Compare compare)
+{
+    return TimSortImpl::FingerSearch(first, last, needleFirst, needleLast, out, true, compare);
+}
+
+#undef TIMSORT_PHASE_CLOCK_TSC
+#undef TIMSORT_THREAD_LOCAL
+
 #endif
@@ -0,0 +1,745 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compare TimSort with std::sort and std::stable_sort over input patterns, sizes and element types.
+// Usage: timsort_bench [max_elems] [type|all] [pattern|all]
+// The sizes are the powers of 10 from 10 to max_elems (default 10^6).
+// A pattern corpus:<path> sorts the keys of a corpus written by timsort_datagen instead, up to max_elems of them.
+// The type matrix sorts max_elems elements (e.g. 100000) of the pattern, random for all, with each comparator cost
+// and element size, and prints the time of TimSort over the time of std::stable_sort as a heat map.
+// The hardware counters are reported per element where the host allows perf events.
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <new>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+#include <unistd.h>
+#include "timsort.h"
+#include "timsort_perf_counters.h"
+#include "timsort_corpus.h"
+
+using namespace std;
+
+// Each measurement sorts at least this many elements in total, in repeated sorts of the small sizes.
+static const size_t kMinElemsPerMeasure = 1000000;
+
+// The hardware counters of the timed sorts, those the host allows.
+static TimSortPerfCounters gCounters;
+
+// ==================
+// Memory accounting
+// ==================
+
+// Every allocation of the process goes through the operators below, which keep the live and the peak bytes.
+// The size is stored in a header in front of the block.
+static size_t gLiveBytes = 0;
+static size_t gPeakBytes = 0;
+static const size_t kAllocHeaderSize = 16;
+
+// The exception specifications of the replaced operators. The dynamic ones are deprecated in C++11 and gone in C++17.
+#if __cplusplus >= 201103L
+#define TIMSORT_BENCH_THROW_BAD_ALLOC
+#define TIMSORT_BENCH_NOTHROW noexcept
+#else
+#define TIMSORT_BENCH_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define TIMSORT_BENCH_NOTHROW throw()
+#endif
+
+static void *Allocate(size_t size)
+{
+    char *p = static_cast<char *>(malloc(size + kAllocHeaderSize));
+    if (p == NULL) {
+        return NULL;
+    }
+    *reinterpret_cast<size_t *>(p) = size;
+    gLiveBytes += size;
+    gPeakBytes = max(gPeakBytes, gLiveBytes);
+    return p + kAllocHeaderSize;
+}
+
+// Not inlined into operator delete, where GCC would take the free of the header for a free of the block new returned.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void Deallocate(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    char *p = static_cast<char *>(ptr) - kAllocHeaderSize;
+    gLiveBytes -= *reinterpret_cast<size_t *>(p);
+    free(p);
+}
+
+void *operator new(size_t size) TIMSORT_BENCH_THROW_BAD_ALLOC
+{
+    void *p = Allocate(size);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size) TIMSORT_BENCH_THROW_BAD_ALLOC
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) TIMSORT_BENCH_NOTHROW
+{
+    return Allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) TIMSORT_BENCH_NOTHROW
+{
+    return Allocate(size);
+}
+
+void operator delete(void *ptr) TIMSORT_BENCH_NOTHROW
+{
+    Deallocate(ptr);
+}
+
+void operator delete[](void *ptr) TIMSORT_BENCH_NOTHROW
+{
+    Deallocate(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) TIMSORT_BENCH_NOTHROW
+{
+    Deallocate(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) TIMSORT_BENCH_NOTHROW
+{
+    Deallocate(ptr);
+}
+
+// C++14 calls the sized forms when the size is known. The header has the size already.
+#if __cplusplus >= 201402L
+void operator delete(void *ptr, size_t) TIMSORT_BENCH_NOTHROW
+{
+    Deallocate(ptr);
+}
+
+void operator delete[](void *ptr, size_t) TIMSORT_BENCH_NOTHROW
+{
+    Deallocate(ptr);
+}
+#endif
+
+#undef TIMSORT_BENCH_THROW_BAD_ALLOC
+#undef TIMSORT_BENCH_NOTHROW
+
+// ==================
+// Element types
+// ==================
+
+// A record of kSize bytes sorted by its first 8 bytes.
+template <size_t kSize>
+struct Record
+{
+    uint64_t mKey;
+    char mPayload[kSize - sizeof(uint64_t)];
+
+    bool operator<(const Record &other) const { return mKey < other.mKey; }
+    bool operator==(const Record &other) const { return mKey == other.mKey; }
+};
+
+template <typename T>
+struct ValueMaker
+{
+    static T Make(uint64_t key) { return static_cast<T>(key); }
+};
+
+template <size_t kSize>
+struct ValueMaker<Record<kSize> >
+{
+    static Record<kSize> Make(uint64_t key)
+    {
+        Record<kSize> record;
+        record.mKey = key;
+        memset(record.mPayload, static_cast<int>(key), sizeof(record.mPayload));
+        return record;
+    }
+};
+
+// Fixed width strings, so that they compare as the keys do. They are longer than the small string buffer.
+template <>
+struct ValueMaker<string>
+{
+    static string Make(uint64_t key)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "key-%020llu", static_cast<unsigned long long>(key));
+        return buffer;
+    }
+};
+
+// The element type of the counting runs: it counts the copies and assignments of T.
+static uint64_t gNumCompares = 0;
+static uint64_t gNumMoves = 0;
+
+template <typename T>
+struct Counted
+{
+    T mValue;
+
+    Counted() : mValue() {}
+    explicit Counted(const T &value) : mValue(value) {}
+    Counted(const Counted &other) : mValue(other.mValue) { ++gNumMoves; }
+
+    Counted &operator=(const Counted &other)
+    {
+        mValue = other.mValue;
+        ++gNumMoves;
+        return *this;
+    }
+
+    bool operator<(const Counted &other) const
+    {
+        ++gNumCompares;
+        return mValue < other.mValue;
+    }
+};
+
+// ==================
+// Input patterns
+// ==================
+
+// xorshift64*, so that the inputs are the same on all platforms.
+struct Random
+{
+    uint64_t mState;
+
+    explicit Random(uint64_t seed) : mState(seed | 1) {}
+
+    uint64_t Next()
+    {
+        mState ^= mState >> 12;
+        mState ^= mState << 25;
+        mState ^= mState >> 27;
+        return mState * 2685821657736338717ULL;
+    }
+};
+
+// The prefix of a pattern argument that names a corpus file.
+static const string kCorpusPrefix = "corpus:";
+
+static const char *kPatterns[] = {
+    "random", "sorted", "reversed", "sawtooth", "organ_pipe", "sorted_tail", "few_unique", "sorted_blocks"
+};
+
+// Fill keys with numElems keys of the pattern.
+void MakeKeys(const string &pattern, size_t numElems, vector<uint64_t> &keys)
+{
+    Random random(2011);
+    keys.resize(numElems);
+
+    for (size_t i = 0; i < numElems; ++i) {
+        if (pattern == "sorted") {
+            keys[i] = i;
+        } else if (pattern == "reversed") {
+            keys[i] = numElems - i;
+        } else if (pattern == "sawtooth") {
+            // 16 ascending teeth.
+            keys[i] = i % (numElems / 16 + 1);
+        } else if (pattern == "organ_pipe") {
+            keys[i] = i < numElems / 2 ? i : numElems - i;
+        } else if (pattern == "few_unique") {
+            keys[i] = random.Next() % 16;
+        } else {
+            keys[i] = random.Next() >> 1;
+        }
+    }
+
+    if (pattern == "sorted_tail") {
+        // Sorted, followed by a random tail of 10%.
+        sort(keys.begin(), keys.begin() + (numElems - numElems / 10));
+    } else if (pattern == "sorted_blocks") {
+        // Sorted blocks of random lengths in [1, 2 * sqrt(numElems)].
+        size_t maxBlockLength = 2 * static_cast<size_t>(sqrt(static_cast<double>(numElems))) + 1;
+        for (size_t first = 0; first < numElems; ) {
+            size_t last = min(numElems, first + 1 + random.Next() % maxBlockLength);
+            sort(keys.begin() + first, keys.begin() + last);
+            first = last;
+        }
+    }
+}
+
+// ==================
+// Measurement
+// ==================
+
+enum Algorithm
+{
+    kTimSort,
+    kStdSort,
+    kStdStableSort,
+    kNumAlgorithms
+};
+
+static const char *kAlgorithmNames[] = { "TimSort", "std::sort", "std::stable_sort" };
+
+template <typename RandomAccessIterator, typename Compare>
+void RunSort(Algorithm algorithm, RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+{
+    switch (algorithm) {
+    case kTimSort:
+        TimSort(first, last, comp);
+        break;
+    case kStdSort:
+        std::sort(first, last, comp);
+        break;
+    default:
+        std::stable_sort(first, last, comp);
+        break;
+    }
+}
+
+template <typename RandomAccessIterator>
+void RunSort(Algorithm algorithm, RandomAccessIterator first, RandomAccessIterator last)
+{
+    RunSort(algorithm, first, last, std::less<typename RandomAccessIterator::value_type>());
+}
+
+double NowInSeconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+struct Result
+{
+    double mNanosPerElem;
+    double mComparesPerElem;
+    double mMovesPerElem;
+    size_t mPeakBytes;      // The memory allocated by the sort beyond the input
+    double mEventsPerElem[TimSortPerfCounters::kNumEvents];
+    bool mIsEventCounted[TimSortPerfCounters::kNumEvents];
+};
+
+template <typename T>
+Result Measure(Algorithm algorithm, const vector<uint64_t> &keys, vector<T> &sorted)
+{
+    size_t numElems = keys.size();
+    size_t numReps = max<size_t>(1, kMinElemsPerMeasure / max<size_t>(numElems, 1));
+    Result result;
+
+    // The time, over copies of the input laid out back to back, and the memory of the first sort.
+    vector<T> input(numElems);
+    for (size_t i = 0; i < numElems; ++i) {
+        input[i] = ValueMaker<T>::Make(keys[i]);
+    }
+    vector<T> work;
+    work.reserve(numReps * numElems);
+    for (size_t rep = 0; rep < numReps; ++rep) {
+        work.insert(work.end(), input.begin(), input.end());
+    }
+
+    gPeakBytes = gLiveBytes;
+    size_t baseBytes = gLiveBytes;
+    RunSort(algorithm, work.begin(), work.begin() + numElems);
+    result.mPeakBytes = gPeakBytes - baseBytes;
+
+    gCounters.Clear();
+    gCounters.Start();
+    double start = NowInSeconds();
+    for (size_t rep = 1; rep < numReps; ++rep) {
+        RunSort(algorithm, work.begin() + rep * numElems, work.begin() + (rep + 1) * numElems);
+    }
+    double seconds = NowInSeconds() - start;
+    gCounters.Stop();
+    size_t numTimedElems = (numReps - 1) * numElems;
+    sorted.assign(work.begin(), work.begin() + numElems);
+
+    if (numReps == 1) {
+        // Time the single sort on a fresh copy, without the memory accounting of the first one.
+        work = input;
+        gCounters.Start();
+        start = NowInSeconds();
+        RunSort(algorithm, work.begin(), work.end());
+        seconds = NowInSeconds() - start;
+        gCounters.Stop();
+        numTimedElems = numElems;
+    }
+
+    numTimedElems = max<size_t>(numTimedElems, 1);
+    result.mNanosPerElem = seconds * 1e9 / numTimedElems;
+    for (int event = 0; event < TimSortPerfCounters::kNumEvents; ++event) {
+        TimSortPerfCounters::Event e = static_cast<TimSortPerfCounters::Event>(event);
+        result.mEventsPerElem[event] = static_cast<double>(gCounters.Get(e)) / numTimedElems;
+        result.mIsEventCounted[event] = gCounters.IsCounted(e);
+    }
+
+    // The counts, in one more sort of the instrumented elements.
+    vector<Counted<T> > counted;
+    counted.reserve(numElems);
+    for (size_t i = 0; i < numElems; ++i) {
+        counted.push_back(Counted<T>(input[i]));
+    }
+    gNumCompares = 0;
+    gNumMoves = 0;
+    RunSort(algorithm, counted.begin(), counted.end());
+    result.mComparesPerElem = static_cast<double>(gNumCompares) / max<size_t>(numElems, 1);
+    result.mMovesPerElem = static_cast<double>(gNumMoves) / max<size_t>(numElems, 1);
+
+    return result;
+}
+
+void Report(const string &type, const string &pattern, size_t numElems, Algorithm algorithm, const Result &result)
+{
+    cout << setw(8) << type << setw(16) << pattern << setw(12) << numElems << setw(18) << kAlgorithmNames[algorithm]
+         << setw(10) << fixed << setprecision(2) << result.mNanosPerElem << " ns/elem"
+         << setw(9) << setprecision(2) << result.mComparesPerElem << " cmp/elem"
+         << setw(9) << setprecision(2) << result.mMovesPerElem << " mov/elem"
+         << setw(12) << result.mPeakBytes / 1024 << " KB peak";
+
+    for (int event = 0; event < TimSortPerfCounters::kNumEvents; ++event) {
+        TimSortPerfCounters::Event e = static_cast<TimSortPerfCounters::Event>(event);
+        if (result.mIsEventCounted[event]) {
+            cout << setw(9) << setprecision(2) << result.mEventsPerElem[event] << " " << TimSortPerfCounters::GetName(e);
+        } else if (gCounters.IsAvailable(e)) {
+            cout << setw(9) << "n/a" << " " << TimSortPerfCounters::GetName(e);
+        }
+    }
+    cout << endl;
+}
+
+// Run all algorithms on the keys, and check that TimSort and std::stable_sort agree.
+template <typename T>
+bool BenchKeys(const string &type, const string &pattern, const vector<uint64_t> &keys)
+{
+    vector<T> gold;
+    for (size_t a = 0; a < kNumAlgorithms; ++a) {
+        vector<T> sorted;
+        Result result = Measure<T>(static_cast<Algorithm>(a), keys, sorted);
+        Report(type, pattern, keys.size(), static_cast<Algorithm>(a), result);
+
+        if (a == kTimSort) {
+            gold.swap(sorted);
+        } else if (a == kStdStableSort && (sorted == gold) == false) {
+            cerr << "TimSort and std::stable_sort differ on " << type << " " << pattern << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename T>
+bool BenchType(const string &type, const string &patternFilter, size_t maxElems, const TimSortCorpus &corpus)
+{
+    if (patternFilter.compare(0, kCorpusPrefix.size(), kCorpusPrefix) == 0) {
+        // The first max_elems keys of the corpus.
+        size_t numElems = min(maxElems, corpus.GetNumElems());
+        vector<uint64_t> keys(corpus.GetKeys(), corpus.GetKeys() + numElems);
+        return BenchKeys<T>(type, corpus.GetShape(), keys);
+    }
+
+    for (size_t p = 0; p < sizeof(kPatterns) / sizeof(kPatterns[0]); ++p) {
+        if (patternFilter != "all" && patternFilter != kPatterns[p]) {
+            continue;
+        }
+
+        for (size_t numElems = 10; numElems <= maxElems; numElems *= 10) {
+            vector<uint64_t> keys;
+            MakeKeys(kPatterns[p], numElems, keys);
+            if (BenchKeys<T>(type, kPatterns[p], keys) == false) {
+                return false;
+            }
+
+            // The next size is over the limit, or would overflow.
+            if (numElems > maxElems / 10) {
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+// ==================
+// Comparator cost and element size matrix
+// ==================
+
+// An element of kSize bytes ordered by its key, the rank of its input key among the distinct keys. The payload
+// starts with the input position, so that equal keys left in another order make the sorted elements differ.
+template <size_t kSize>
+struct MatrixElem
+{
+    uint32_t mKey;
+    char mPayload[kSize - sizeof(uint32_t)];
+
+    void SetPayload(uint32_t position)
+    {
+        memset(mPayload, 0, sizeof(mPayload));
+        memcpy(mPayload, &position, sizeof(position));
+    }
+
+    bool operator==(const MatrixElem &other) const { return memcmp(this, &other, kSize) == 0; }
+};
+
+template <>
+struct MatrixElem<4>
+{
+    uint32_t mKey;
+
+    void SetPayload(uint32_t /*position*/) {}
+
+    bool operator==(const MatrixElem &other) const { return mKey == other.mKey; }
+};
+
+static const size_t kMatrixElemSizes[] = { 4, 8, 16, 64, 256, 1024 };
+static const size_t kNumMatrixElemSizes = sizeof(kMatrixElemSizes) / sizeof(kMatrixElemSizes[0]);
+
+enum MatrixComparator
+{
+    kInlineCompare,     // The keys compared in the sort loop
+    kFunctionCompare,   // The keys compared by a call through a function pointer
+    kStringCompare,     // The strings of the keys, looked up in a table, compared
+    kSlowCompare,       // The keys compared after a busy wait
+    kNumMatrixComparators
+};
+
+static const char *kMatrixComparatorNames[] = { "inline", "fnptr", "string", "slow" };
+
+// The iterations of the busy wait of the slow comparisons.
+static const int kSlowCompareSpins = 16;
+
+struct InlineCompare
+{
+    template <typename T>
+    bool operator()(const T &a, const T &b) const { return a.mKey < b.mKey; }
+};
+
+template <typename T>
+bool LessByKey(const T &a, const T &b)
+{
+    return a.mKey < b.mKey;
+}
+
+class StringCompare
+{
+public:
+    explicit StringCompare(const vector<string> &strings) : mStrings(&strings) {}
+
+    template <typename T>
+    bool operator()(const T &a, const T &b) const { return (*mStrings)[a.mKey] < (*mStrings)[b.mKey]; }
+
+private:
+    const vector<string> *mStrings;
+};
+
+struct SlowCompare
+{
+    template <typename T>
+    bool operator()(const T &a, const T &b) const
+    {
+        for (volatile int i = 0; i < kSlowCompareSpins; ++i) {
+        }
+        return a.mKey < b.mKey;
+    }
+};
+
+// The values of a cell printed by PrintMatrix.
+enum MatrixValue
+{
+    kTimSortTime,
+    kStableSortTime,
+    kTimeRatio
+};
+
+struct MatrixCell
+{
+    double mTimSortNanosPerElem;
+    double mStableSortNanosPerElem;
+};
+
+// The time of the sorts of copies of the input, per element. The last sorted copy is returned in sorted.
+template <typename T, typename Compare>
+double TimeSorts(Algorithm algorithm, const vector<T> &input, Compare comp, vector<T> &sorted)
+{
+    size_t numElems = max<size_t>(input.size(), 1);
+    size_t numReps = max<size_t>(1, kMinElemsPerMeasure / numElems);
+    double seconds = 0.0;
+
+    for (size_t rep = 0; rep < numReps; ++rep) {
+        sorted = input;
+        double start = NowInSeconds();
+        RunSort(algorithm, sorted.begin(), sorted.end(), comp);
+        seconds += NowInSeconds() - start;
+    }
+
+    return seconds * 1e9 / (numReps * numElems);
+}
+
+template <size_t kSize, typename Compare>
+bool MeasureMatrixCell(const vector<uint32_t> &ranks, Compare comp, MatrixCell &cell)
+{
+    vector<MatrixElem<kSize> > input(ranks.size());
+    for (size_t i = 0; i < ranks.size(); ++i) {
+        input[i].mKey = ranks[i];
+        input[i].SetPayload(static_cast<uint32_t>(i));
+    }
+
+    vector<MatrixElem<kSize> > timSorted;
+    vector<MatrixElem<kSize> > stableSorted;
+    cell.mTimSortNanosPerElem = TimeSorts(kTimSort, input, comp, timSorted);
+    cell.mStableSortNanosPerElem = TimeSorts(kStdStableSort, input, comp, stableSorted);
+    return timSorted == stableSorted;
+}
+
+// Measure the cells of all comparators for the elements of kSize bytes.
+template <size_t kSize>
+bool MeasureMatrixColumn(const vector<uint32_t> &ranks, const vector<string> &strings, MatrixCell *column)
+{
+    typedef MatrixElem<kSize> Elem;
+
+    // Read through a volatile, so that the compiler cannot inline the calls.
+    bool (*volatile lessByKey)(const Elem &, const Elem &) = LessByKey<Elem>;
+    bool (*less)(const Elem &, const Elem &) = lessByKey;
+
+    return MeasureMatrixCell<kSize>(ranks, InlineCompare(), column[kInlineCompare]) &&
+           MeasureMatrixCell<kSize>(ranks, less, column[kFunctionCompare]) &&
+           MeasureMatrixCell<kSize>(ranks, StringCompare(strings), column[kStringCompare]) &&
+           MeasureMatrixCell<kSize>(ranks, SlowCompare(), column[kSlowCompare]);
+}
+
+// Print one value of the cells as a table of the comparators by the element sizes. A heat map colors the ratios
+// of TimSort to std::stable_sort on a terminal: green where TimSort is faster by 10%, red where it is slower.
+void PrintMatrix(const string &title, MatrixCell cells[][kNumMatrixComparators], MatrixValue value)
+{
+    bool isColored = value == kTimeRatio && isatty(STDOUT_FILENO);
+
+    cout << endl << title << endl << setw(10) << "";
+    for (size_t s = 0; s < kNumMatrixElemSizes; ++s) {
+        cout << setw(9) << kMatrixElemSizes[s] << "B";
+    }
+    cout << endl;
+
+    for (size_t c = 0; c < kNumMatrixComparators; ++c) {
+        cout << setw(10) << kMatrixComparatorNames[c];
+        for (size_t s = 0; s < kNumMatrixElemSizes; ++s) {
+            const MatrixCell &cell = cells[s][c];
+            double x = value == kTimSortTime ? cell.mTimSortNanosPerElem :
+                       value == kStableSortTime ? cell.mStableSortNanosPerElem :
+                       cell.mTimSortNanosPerElem / cell.mStableSortNanosPerElem;
+            const char *color = x < 0.9 ? "\033[42m" : x > 1.1 ? "\033[41m" : "";
+            cout << (isColored ? color : "") << setw(10) << fixed << setprecision(2) << x << (isColored ? "\033[0m" : "");
+        }
+        cout << endl;
+    }
+}
+
+// Sort the keys with each comparator and element size, by TimSort and by std::stable_sort.
+bool BenchMatrix(const string &pattern, const vector<uint64_t> &keys)
+{
+    // The ranks of the keys, so that all comparators sort them in the same order.
+    vector<uint64_t> distinctKeys(keys);
+    sort(distinctKeys.begin(), distinctKeys.end());
+    distinctKeys.erase(unique(distinctKeys.begin(), distinctKeys.end()), distinctKeys.end());
+    vector<uint32_t> ranks(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ranks[i] = static_cast<uint32_t>(lower_bound(distinctKeys.begin(), distinctKeys.end(), keys[i]) -
+                                         distinctKeys.begin());
+    }
+    vector<string> strings(distinctKeys.size());
+    for (size_t rank = 0; rank < strings.size(); ++rank) {
+        strings[rank] = ValueMaker<string>::Make(rank);
+    }
+
+    MatrixCell cells[kNumMatrixElemSizes][kNumMatrixComparators];
+    bool isOk = MeasureMatrixColumn<4>(ranks, strings, cells[0]) &&
+                MeasureMatrixColumn<8>(ranks, strings, cells[1]) &&
+                MeasureMatrixColumn<16>(ranks, strings, cells[2]) &&
+                MeasureMatrixColumn<64>(ranks, strings, cells[3]) &&
+                MeasureMatrixColumn<256>(ranks, strings, cells[4]) &&
+                MeasureMatrixColumn<1024>(ranks, strings, cells[5]);
+    if (isOk == false) {
+        cerr << "TimSort and std::stable_sort differ on the matrix of " << pattern << endl;
+        return false;
+    }
+
+    cout << "pattern " << pattern << ", " << keys.size() << " elems" << endl;
+    PrintMatrix("TimSort ns/elem", cells, kTimSortTime);
+    PrintMatrix("std::stable_sort ns/elem", cells, kStableSortTime);
+    PrintMatrix("TimSort / std::stable_sort time", cells, kTimeRatio);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t maxElems = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    string typeFilter = argc > 2 ? argv[2] : "all";
+    string patternFilter = argc > 3 ? argv[3] : "all";
+
+    if (gCounters.GetError().empty() == false) {
+        cerr << "Some perf counters are not reported, " << gCounters.GetError() << endl;
+    }
+
+    TimSortCorpus corpus;
+    if (patternFilter.compare(0, kCorpusPrefix.size(), kCorpusPrefix) == 0 &&
+        corpus.Open(patternFilter.substr(kCorpusPrefix.size())) == false) {
+        cerr << corpus.GetError() << endl;
+        return 1;
+    }
+
+    if (typeFilter == "matrix") {
+        vector<uint64_t> keys;
+        if (patternFilter.compare(0, kCorpusPrefix.size(), kCorpusPrefix) == 0) {
+            keys.assign(corpus.GetKeys(), corpus.GetKeys() + min(maxElems, corpus.GetNumElems()));
+            return BenchMatrix(corpus.GetShape(), keys) ? 0 : 1;
+        }
+        string pattern = patternFilter == "all" ? "random" : patternFilter;
+        MakeKeys(pattern, maxElems, keys);
+        return BenchMatrix(pattern, keys) ? 0 : 1;
+    }
+
+    bool isOk = true;
+    if (typeFilter == "all" || typeFilter == "int32") {
+        isOk = isOk && BenchType<int32_t>("int32", patternFilter, maxElems, corpus);
+    }
+    if (typeFilter == "all" || typeFilter == "int64") {
+        isOk = isOk && BenchType<int64_t>("int64", patternFilter, maxElems, corpus);
+    }
+    if (typeFilter == "all" || typeFilter == "double") {
+        isOk = isOk && BenchType<double>("double", patternFilter, maxElems, corpus);
+    }
+    if (typeFilter == "all" || typeFilter == "rec16") {
+        isOk = isOk && BenchType<Record<16> >("rec16", patternFilter, maxElems, corpus);
+    }
+    if (typeFilter == "all" || typeFilter == "rec64") {
+        isOk = isOk && BenchType<Record<64> >("rec64", patternFilter, maxElems, corpus);
+    }
+    if (typeFilter == "all" || typeFilter == "rec256") {
+        isOk = isOk && BenchType<Record<256> >("rec256", patternFilter, maxElems, corpus);
+    }
+    if (typeFilter == "all" || typeFilter == "string") {
+        isOk = isOk && BenchType<string>("string", patternFilter, maxElems, corpus);
+    }
+
+    return isOk ? 0 : 1;
+}
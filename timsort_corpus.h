@@ -0,0 +1,185 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMSORT_CORPUS_H
+#define TIMSORT_CORPUS_H
+
+// The file format of the benchmark corpora written by timsort_datagen: a header and a raw array of keys.
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * The header at the start of a corpus file. The numElems keys follow it as uint64_t, in the byte order of the
+ * writer; a reader of the other byte order sees a wrong version and rejects the file.
+ *
+ * The header is 64 bytes, so that the keys are aligned in a mapped file.
+ */
+struct TimSortCorpusHeader
+{
+    char mMagic[8];             // "TSCORPUS"
+    uint32_t mVersion;
+    uint32_t mKeySize;          // sizeof(uint64_t)
+    uint64_t mNumElems;
+    uint64_t mSeed;             // The seed of the generator
+    char mShape[32];            // The name of the shape, NUL terminated
+};
+
+/**
+ * A corpus file mapped read only.
+ */
+class TimSortCorpus
+{
+public:
+    static const uint32_t kVersion = 1;
+
+    TimSortCorpus() : mMap(NULL), mMapSize(0) {}
+
+    ~TimSortCorpus() { Close(); }
+
+    /**
+     * Map the corpus at path.
+     * @return false if the file cannot be mapped or is not a corpus. GetError tells why.
+     */
+    bool Open(const std::string &path);
+
+    void Close();
+
+    const std::string &GetError() const { return mError; }
+
+    size_t GetNumElems() const { return static_cast<size_t>(GetHeader().mNumElems); }
+
+    uint64_t GetSeed() const { return GetHeader().mSeed; }
+
+    std::string GetShape() const { return GetHeader().mShape; }
+
+    const uint64_t *GetKeys() const
+    {
+        return reinterpret_cast<const uint64_t *>(static_cast<const char *>(mMap) + sizeof(TimSortCorpusHeader));
+    }
+
+    /**
+     * Write keys as a corpus of the shape to path.
+     * @return false if any file operation failed, with the reason in error.
+     */
+    static bool Write(const std::string &path, const std::string &shape, uint64_t seed,
+                      const std::vector<uint64_t> &keys, std::string &error);
+
+private:
+    // Not copyable, it owns the mapping.
+    TimSortCorpus(const TimSortCorpus &);
+    TimSortCorpus &operator=(const TimSortCorpus &);
+
+    const TimSortCorpusHeader &GetHeader() const { return *static_cast<const TimSortCorpusHeader *>(mMap); }
+
+    void *mMap;
+    size_t mMapSize;
+    std::string mError;
+};
+
+inline bool TimSortCorpus::Open(const std::string &path)
+{
+    Close();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        mError = path + ": " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TimSortCorpusHeader)) {
+        mError = path + ": too short for a corpus header";
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        mError = path + ": " + strerror(errno);
+        return false;
+    }
+    mMap = map;
+    mMapSize = static_cast<size_t>(st.st_size);
+
+    const TimSortCorpusHeader &header = GetHeader();
+    if (memcmp(header.mMagic, "TSCORPUS", sizeof(header.mMagic)) != 0) {
+        mError = path + ": not a corpus";
+    } else if (header.mVersion != kVersion || header.mKeySize != sizeof(uint64_t)) {
+        mError = path + ": unsupported version, key size or byte order";
+    } else if (memchr(header.mShape, '\0', sizeof(header.mShape)) == NULL) {
+        mError = path + ": bad shape name";
+    } else if ((mMapSize - sizeof(TimSortCorpusHeader)) / sizeof(uint64_t) != header.mNumElems) {
+        mError = path + ": the file size does not match the number of elements";
+    } else {
+        mError.clear();
+        return true;
+    }
+
+    Close();
+    return false;
+}
+
+inline void TimSortCorpus::Close()
+{
+    if (mMap != NULL) {
+        munmap(mMap, mMapSize);
+        mMap = NULL;
+        mMapSize = 0;
+    }
+}
+
+inline bool TimSortCorpus::Write(const std::string &path, const std::string &shape, uint64_t seed,
+                                 const std::vector<uint64_t> &keys, std::string &error)
+{
+    TimSortCorpusHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.mMagic, "TSCORPUS", sizeof(header.mMagic));
+    header.mVersion = kVersion;
+    header.mKeySize = sizeof(uint64_t);
+    header.mNumElems = keys.size();
+    header.mSeed = seed;
+    if (shape.size() >= sizeof(header.mShape)) {
+        error = "shape name too long: " + shape;
+        return false;
+    }
+    memcpy(header.mShape, shape.c_str(), shape.size());
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    bool isOk = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                (keys.empty() || fwrite(&keys[0], sizeof(uint64_t), keys.size(), file) == keys.size());
+    if (fclose(file) != 0 || isOk == false) {
+        error = path + ": write failed";
+        remove(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
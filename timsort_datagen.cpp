@@ -0,0 +1,194 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Write a benchmark corpus of a realistic shape, for timsort_bench corpus:<path>.
+// Usage: timsort_datagen <shape> <num_elems> [seed] [output]
+// The output defaults to <shape>.corpus. The same shape, size and seed give the same file on all platforms.
+// The keys are below 2^31, so that the int32 runs of the benchmark sort them in the same order.
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <cstdlib>
+#include <stdint.h>
+#include "timsort_corpus.h"
+
+using namespace std;
+
+static const uint64_t kMaxKey = 0x7fffffff;
+
+// xorshift64*, so that the corpora are the same on all platforms.
+struct Random
+{
+    uint64_t mState;
+
+    explicit Random(uint64_t seed) : mState(seed | 1) {}
+
+    uint64_t Next()
+    {
+        mState ^= mState >> 12;
+        mState ^= mState << 25;
+        mState ^= mState >> 27;
+        return mState * 2685821657736338717ULL;
+    }
+
+    // A double in [0, 1).
+    double NextDouble() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// Log lines merged from many writers: millisecond timestamps that arrive up to about 64 lines late.
+void MakeLogTimestamps(size_t numElems, Random &random, vector<uint64_t> &keys)
+{
+    vector<pair<uint64_t, uint64_t> > arrivals(numElems);
+    uint64_t time = 0;
+    for (size_t i = 0; i < numElems; ++i) {
+        time += random.Next() % 3;
+        arrivals[i].first = time + random.Next() % 64;
+        arrivals[i].second = time;
+    }
+    // The arrival ties are broken by the timestamp, as a stable sort of the lines by arrival would.
+    sort(arrivals.begin(), arrivals.end());
+
+    for (size_t i = 0; i < numElems; ++i) {
+        keys[i] = arrivals[i].second;
+    }
+}
+
+// An append-only table sorted by its row ids, followed by a batch of updates to 10% of random rows.
+void MakeAppendUpdates(size_t numElems, Random &random, vector<uint64_t> &keys)
+{
+    size_t numRows = numElems - numElems / 10;
+    for (size_t i = 0; i < numRows; ++i) {
+        keys[i] = i;
+    }
+    for (size_t i = numRows; i < numElems; ++i) {
+        keys[i] = numRows == 0 ? 0 : random.Next() % numRows;
+    }
+}
+
+// Keys drawn from a Zipf distribution of exponent 1 over numElems distinct keys. The ranks are scattered over the
+// key space, so that the hot keys are not the smallest ones.
+void MakeZipf(size_t numElems, Random &random, vector<uint64_t> &keys)
+{
+    size_t numKeys = max<size_t>(numElems, 1);
+    vector<double> cdf(numKeys);
+    double sum = 0.0;
+    for (size_t rank = 0; rank < numKeys; ++rank) {
+        sum += 1.0 / (rank + 1);
+        cdf[rank] = sum;
+    }
+
+    for (size_t i = 0; i < numElems; ++i) {
+        size_t rank = lower_bound(cdf.begin(), cdf.end(), random.NextDouble() * sum) - cdf.begin();
+        rank = min(rank, numKeys - 1);
+        // An odd multiplier is a permutation of the keys modulo 2^31.
+        keys[i] = (rank * 2654435761ULL) & kMaxKey;
+    }
+}
+
+// 16 sorted shards of random keys, concatenated, as the outputs of parallel sorts.
+void MakeSortedShards(size_t numElems, Random &random, vector<uint64_t> &keys)
+{
+    const size_t kNumShards = 16;
+
+    for (size_t i = 0; i < numElems; ++i) {
+        keys[i] = random.Next() & kMaxKey;
+    }
+    for (size_t shard = 0; shard < kNumShards; ++shard) {
+        sort(keys.begin() + shard * numElems / kNumShards, keys.begin() + (shard + 1) * numElems / kNumShards);
+    }
+}
+
+// Descending keys with 1% of the elements swapped with a neighbour at most 16 positions away.
+void MakeNearlyReversed(size_t numElems, Random &random, vector<uint64_t> &keys)
+{
+    for (size_t i = 0; i < numElems; ++i) {
+        keys[i] = numElems - i;
+    }
+    for (size_t n = 0; n < numElems / 100; ++n) {
+        size_t i = random.Next() % numElems;
+        size_t j = min(numElems - 1, i + 1 + random.Next() % 16);
+        swap(keys[i], keys[j]);
+    }
+}
+
+// Categorical data: 12 categories of geometric frequencies, in bursts of the same category as rows of a batch.
+void MakeCategorical(size_t numElems, Random &random, vector<uint64_t> &keys)
+{
+    const uint64_t kNumCategories = 12;
+
+    for (size_t i = 0; i < numElems; ) {
+        uint64_t category = 0;
+        while (category + 1 < kNumCategories && (random.Next() & 1)) {
+            ++category;
+        }
+        size_t last = min(numElems, i + 1 + random.Next() % 32);
+        for (; i < last; ++i) {
+            keys[i] = category;
+        }
+    }
+}
+
+struct Shape
+{
+    const char *mName;
+    void (*mMake)(size_t numElems, Random &random, vector<uint64_t> &keys);
+};
+
+static const Shape kShapes[] = {
+    { "log_timestamps", MakeLogTimestamps },
+    { "append_updates", MakeAppendUpdates },
+    { "zipf", MakeZipf },
+    { "sorted_shards", MakeSortedShards },
+    { "nearly_reversed", MakeNearlyReversed },
+    { "categorical", MakeCategorical }
+};
+
+int main(int argc, char *argv[])
+{
+    const Shape *shape = NULL;
+    for (size_t s = 0; argc > 2 && s < sizeof(kShapes) / sizeof(kShapes[0]); ++s) {
+        if (string(argv[1]) == kShapes[s].mName) {
+            shape = &kShapes[s];
+        }
+    }
+    if (shape == NULL) {
+        cerr << "Usage: timsort_datagen <shape> <num_elems> [seed] [output]" << endl << "Shapes:";
+        for (size_t s = 0; s < sizeof(kShapes) / sizeof(kShapes[0]); ++s) {
+            cerr << " " << kShapes[s].mName;
+        }
+        cerr << endl;
+        return 1;
+    }
+
+    size_t numElems = strtoul(argv[2], NULL, 10);
+    uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 2011;
+    string output = argc > 4 ? argv[4] : string(shape->mName) + ".corpus";
+
+    Random random(seed);
+    vector<uint64_t> keys(numElems);
+    shape->mMake(numElems, random, keys);
+
+    string error;
+    if (TimSortCorpus::Write(output, shape->mName, seed, keys, error) == false) {
+        cerr << error << endl;
+        return 1;
+    }
+    return 0;
+}
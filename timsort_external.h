@@ -0,0 +1,409 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMSORT_EXTERNAL_H
+#define TIMSORT_EXTERNAL_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "timsort.h"
+
+/**
+ * What the last external sort did.
+ */
+struct TimSortExternalStats
+{
+    uint64_t mInputBytes;   // Bytes read from the input file
+    uint64_t mSpillBytes;   // Bytes written to the spill files, the output file is not counted
+    uint32_t mNumRuns;      // Number of sorted runs produced from the input chunks
+    uint32_t mNumPasses;    // Number of merge passes, 0 if the input fits in one chunk
+    uint32_t mMergeFanIn;   // The widest merge done, i.e. the number of runs merged at once
+
+    TimSortExternalStats() : mInputBytes(0), mSpillBytes(0), mNumRuns(0), mNumPasses(0), mMergeFanIn(0) {}
+};
+
+/**
+ * Sort a binary file of fixed-size records T that does not fit in memory.
+ *
+ * The input is read in chunks bounded by the memory budget. Each chunk is sorted by TimSort and spilled to
+ * a temporary file as one run. The runs are then merged k at a time with bounded read buffers until one run
+ * is left, which is written to the output file. The merge is stable, so the whole sort is stable.
+ *
+ * T must be trivially copyable since the records are read and written with fread()/fwrite().
+ */
+template <typename T, typename Compare = std::less<T> >
+class TimSortExternal
+{
+public:
+    // The smallest read buffer of a merge input. It bounds the merge fan-in for a given memory budget.
+    static const size_t kMinMergeBufferBytes = 64 * 1024;
+
+    // Keep the number of open spill files well below the usual file descriptor limit.
+    static const size_t kMaxMergeFanIn = 512;
+
+    /**
+     * @param memoryBudget The bytes that may be used for the records in memory, including TimSort's merge area.
+     * @param tmpDir The directory where the spill files are created.
+     */
+    TimSortExternal(size_t memoryBudget, const std::string &tmpDir, Compare comp = Compare())
+        : mMemoryBudget(memoryBudget), mTmpDir(tmpDir), mComp(comp)
+    {
+    }
+
+    ~TimSortExternal()
+    {
+        RemoveSpillFiles(mRuns);
+    }
+
+    /**
+     * Sort the records in inputPath and write them to outputPath.
+     * @return false if any file operation failed or the input size is not a multiple of sizeof(T).
+     *         The spill files are removed in any case.
+     */
+    bool Sort(const std::string &inputPath, const std::string &outputPath);
+
+    const TimSortExternalStats &GetStats() const { return mStats; }
+
+private:
+    /**
+     * A spill file holding one sorted run.
+     */
+    struct SpillRun
+    {
+        std::string mPath;
+        uint64_t mNumElems;
+    };
+
+    /**
+     * A merge input: one spill run read through a bounded buffer.
+     */
+    struct MergeSource
+    {
+        FILE *mFile;
+        std::vector<T> mBuffer;
+        typename std::vector<T>::iterator mCursor;
+        typename std::vector<T>::iterator mEnd;
+        size_t mRunIndex;   // The position of the run in the input order, used to break ties stably.
+    };
+
+    /**
+     * Order merge sources in a heap by their current element. Equal elements are taken from the earlier run first.
+     * std heaps keep the greatest element on top, so "less" means "merged later".
+     */
+    class SourceCompare
+    {
+    public:
+        SourceCompare(const std::vector<MergeSource> &sources, Compare comp) : mSources(&sources), mComp(comp) {}
+
+        bool operator()(size_t a, size_t b) const
+        {
+            const MergeSource &sa = (*mSources)[a];
+            const MergeSource &sb = (*mSources)[b];
+            if (mComp(*sb.mCursor, *sa.mCursor)) {
+                return true;
+            }
+            return mComp(*sa.mCursor, *sb.mCursor) == false && sb.mRunIndex < sa.mRunIndex;
+        }
+
+    private:
+        const std::vector<MergeSource> *mSources;
+        Compare mComp;
+    };
+
+    // Read the input chunk by chunk, sort each chunk and spill it as a run.
+    bool SpillRuns(FILE *input, FILE *output);
+
+    // Merge mRuns[first, last) into the file out. The number of elements of the output is returned in numElems.
+    bool MergeRuns(size_t first, size_t last, FILE *out, uint64_t &numElems);
+
+    // Refill the buffer of the source. Returns false on a read error.
+    bool FillSource(MergeSource &source);
+
+    bool CreateSpillFile(SpillRun &run, FILE *&file);
+
+    bool WriteElems(FILE *file, typename std::vector<T>::const_iterator first, typename std::vector<T>::const_iterator last);
+
+    static void RemoveSpillFiles(std::vector<SpillRun> &runs);
+
+    size_t mMemoryBudget;
+    std::string mTmpDir;
+    Compare mComp;
+
+    std::vector<SpillRun> mRuns;
+    TimSortExternalStats mStats;
+};
+
+template <typename T, typename Compare>
+const size_t TimSortExternal<T, Compare>::kMinMergeBufferBytes;
+
+template <typename T, typename Compare>
+const size_t TimSortExternal<T, Compare>::kMaxMergeFanIn;
+
+template <typename T, typename Compare>
+bool TimSortExternal<T, Compare>::Sort(const std::string &inputPath, const std::string &outputPath)
+{
+    mStats = TimSortExternalStats();
+    RemoveSpillFiles(mRuns);
+
+    FILE *input = fopen(inputPath.c_str(), "rb");
+    if (input == NULL) {
+        return false;
+    }
+    FILE *output = fopen(outputPath.c_str(), "wb");
+    if (output == NULL) {
+        fclose(input);
+        return false;
+    }
+
+    bool isOk = SpillRuns(input, output);
+    fclose(input);
+
+    // Each merge pass merges groups of fanIn consecutive runs, so the order of equal elements is kept.
+    size_t fanIn = mMemoryBudget / kMinMergeBufferBytes;
+    fanIn = std::max<size_t>(2, std::min<size_t>(fanIn, kMaxMergeFanIn));
+    while (isOk && mRuns.size() > 1) {
+        ++mStats.mNumPasses;
+        mStats.mMergeFanIn = std::max<uint32_t>(mStats.mMergeFanIn, std::min(fanIn, mRuns.size()));
+
+        if (mRuns.size() <= fanIn) {
+            uint64_t numElems;
+            isOk = MergeRuns(0, mRuns.size(), output, numElems);
+            break;
+        }
+
+        std::vector<SpillRun> mergedRuns;
+        for (size_t first = 0; isOk && first < mRuns.size(); first += fanIn) {
+            size_t last = std::min(first + fanIn, mRuns.size());
+            SpillRun run;
+            FILE *file;
+            if (last - first == 1) {
+                // Nothing to merge with, the run is carried to the next pass as is.
+                mergedRuns.push_back(mRuns[first]);
+                mRuns[first].mPath.clear();
+                continue;
+            }
+            isOk = CreateSpillFile(run, file);
+            if (isOk) {
+                isOk = MergeRuns(first, last, file, run.mNumElems);
+                isOk = fclose(file) == 0 && isOk;
+                mergedRuns.push_back(run);
+                mStats.mSpillBytes += run.mNumElems * sizeof(T);
+            }
+        }
+        RemoveSpillFiles(mRuns);
+        mRuns.swap(mergedRuns);
+    }
+
+    RemoveSpillFiles(mRuns);
+    isOk = fclose(output) == 0 && isOk;
+
+    return isOk;
+}
+
+template <typename T, typename Compare>
+bool TimSortExternal<T, Compare>::SpillRuns(FILE *input, FILE *output)
+{
+    // TimSort needs up to half of the chunk as merge area.
+    size_t chunkSize = std::max<size_t>(1, mMemoryBudget / sizeof(T) * 2 / 3);
+    std::vector<T> chunk(chunkSize);
+
+    // Read bytes, not records, so that a trailing partial record is seen instead of dropped.
+    size_t numBytes;
+    while ((numBytes = fread(&chunk[0], 1, chunkSize * sizeof(T), input)) > 0) {
+        if (numBytes % sizeof(T) != 0) {
+            return false;
+        }
+        size_t numRead = numBytes / sizeof(T);
+        chunk.resize(numRead);
+        mStats.mInputBytes += numRead * sizeof(T);
+        TimSort(chunk.begin(), chunk.end(), mComp);
+        ++mStats.mNumRuns;
+
+        if (mRuns.empty() && numRead < chunkSize) {
+            // The whole input fits in one chunk, write it to the output directly.
+            return WriteElems(output, chunk.begin(), chunk.end());
+        }
+
+        SpillRun run;
+        FILE *file;
+        if (CreateSpillFile(run, file) == false) {
+            return false;
+        }
+        run.mNumElems = numRead;
+        mRuns.push_back(run);
+        bool isOk = WriteElems(file, chunk.begin(), chunk.end());
+        if (fclose(file) != 0 || isOk == false) {
+            return false;
+        }
+        mStats.mSpillBytes += numRead * sizeof(T);
+
+        chunk.resize(chunkSize);
+    }
+
+    if (ferror(input)) {
+        return false;
+    }
+
+    // The input was an exact multiple of the chunk size and produced a single run.
+    if (mRuns.size() == 1) {
+        uint64_t numElems;
+        return MergeRuns(0, 1, output, numElems);
+    }
+
+    return true;
+}
+
+template <typename T, typename Compare>
+bool TimSortExternal<T, Compare>::MergeRuns(size_t first, size_t last, FILE *out, uint64_t &numElems)
+{
+    numElems = 0;
+
+    // One read buffer per input run, plus one for the output.
+    size_t numSources = last - first;
+    size_t bufferSize = std::max<size_t>(1, mMemoryBudget / sizeof(T) / (numSources + 1));
+
+    std::vector<MergeSource> sources(numSources);
+    std::vector<size_t> heap;
+    bool isOk = true;
+    for (size_t i = 0; i < numSources; ++i) {
+        MergeSource &source = sources[i];
+        source.mFile = fopen(mRuns[first + i].mPath.c_str(), "rb");
+        source.mBuffer.resize(bufferSize);
+        source.mCursor = source.mEnd = source.mBuffer.begin();
+        source.mRunIndex = i;
+        if (source.mFile == NULL || FillSource(source) == false) {
+            isOk = false;
+            break;
+        }
+        if (source.mCursor != source.mEnd) {
+            heap.push_back(i);
+        }
+    }
+
+    SourceCompare heapComp(sources, mComp);
+    std::make_heap(heap.begin(), heap.end(), heapComp);
+
+    std::vector<T> outBuffer;
+    outBuffer.reserve(bufferSize);
+
+    while (isOk && heap.empty() == false) {
+        MergeSource &top = sources[heap[0]];
+
+        // The top source keeps winning as long as its elements are ordered before the head of the runner-up,
+        // which is one of the two children of the heap root. Gallop to find how far that is.
+        typename std::vector<T>::iterator p = top.mEnd;
+        if (heap.size() > 1) {
+            size_t second = heap[1];
+            if (heap.size() > 2 && heapComp(heap[1], heap[2])) {
+                second = heap[2];
+            }
+            const T &value = *sources[second].mCursor;
+            if (top.mRunIndex < sources[second].mRunIndex) {
+                p = TimSortDetail::GallopRight(top.mCursor, top.mEnd, top.mCursor, value, mComp);
+            } else {
+                p = TimSortDetail::GallopLeft(top.mCursor, top.mEnd, top.mCursor, value, mComp);
+            }
+            assert(p > top.mCursor);
+        }
+
+        // Move the winning block to the output buffer, flushing it when full.
+        while (top.mCursor < p) {
+            size_t count = std::min<size_t>(p - top.mCursor, bufferSize - outBuffer.size());
+            outBuffer.insert(outBuffer.end(), top.mCursor, top.mCursor + count);
+            top.mCursor += count;
+            if (outBuffer.size() == bufferSize) {
+                isOk = WriteElems(out, outBuffer.begin(), outBuffer.end());
+                numElems += outBuffer.size();
+                outBuffer.clear();
+            }
+        }
+
+        std::pop_heap(heap.begin(), heap.end(), heapComp);
+        if (top.mCursor == top.mEnd && (FillSource(top) == false || top.mCursor == top.mEnd)) {
+            isOk = isOk && ferror(top.mFile) == 0;
+            heap.pop_back();
+        } else {
+            std::push_heap(heap.begin(), heap.end(), heapComp);
+        }
+    }
+
+    if (isOk && outBuffer.empty() == false) {
+        isOk = WriteElems(out, outBuffer.begin(), outBuffer.end());
+        numElems += outBuffer.size();
+    }
+
+    for (size_t i = 0; i < numSources; ++i) {
+        if (sources[i].mFile != NULL) {
+            fclose(sources[i].mFile);
+        }
+    }
+
+    return isOk;
+}
+
+template <typename T, typename Compare>
+bool TimSortExternal<T, Compare>::FillSource(MergeSource &source)
+{
+    size_t numRead = fread(&source.mBuffer[0], sizeof(T), source.mBuffer.size(), source.mFile);
+    source.mCursor = source.mBuffer.begin();
+    source.mEnd = source.mCursor + numRead;
+    return ferror(source.mFile) == 0;
+}
+
+template <typename T, typename Compare>
+bool TimSortExternal<T, Compare>::CreateSpillFile(SpillRun &run, FILE *&file)
+{
+    std::string path = mTmpDir + "/timsort_spill_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        return false;
+    }
+
+    file = fdopen(fd, "wb");
+    if (file == NULL) {
+        close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    run.mPath = path;
+    run.mNumElems = 0;
+    return true;
+}
+
+template <typename T, typename Compare>
+bool TimSortExternal<T, Compare>::WriteElems(
+        FILE *file, typename std::vector<T>::const_iterator first, typename std::vector<T>::const_iterator last)
+{
+    size_t numElems = std::distance(first, last);
+    return numElems == 0 || fwrite(&*first, sizeof(T), numElems, file) == numElems;
+}
+
+template <typename T, typename Compare>
+void TimSortExternal<T, Compare>::RemoveSpillFiles(std::vector<SpillRun> &runs)
+{
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (runs[i].mPath.empty() == false) {
+            unlink(runs[i].mPath.c_str());
+        }
+    }
+    runs.clear();
+}
+
+#endif
@@ -0,0 +1,186 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMSORT_JOIN_H
+#define TIMSORT_JOIN_H
+
+#include <vector>
+#include <utility>
+#include "timsort.h"
+
+enum TimJoinType
+{
+    kTimInnerJoin,       // Every pair of left and right rows with equal keys
+    kTimLeftOuterJoin,   // The inner join, plus every left row without a match paired with the end of the right table
+    kTimSemiJoin         // Every left row with at least one match, paired with its first match
+};
+
+// ==================
+// Declaration
+// ==================
+
+/**
+ * Sort-merge join of the left rows [leftFirst, leftLast) and the right rows [rightFirst, rightLast).
+ *
+ * comp compares the join keys of two rows. It is called with left and right rows in any combination,
+ * so it must provide operator() for (left, left), (right, right), (left, right) and (right, left).
+ *
+ * A table that is not sorted by the key is sorted in place by TimSort, so the join is stable: the pairs come out
+ * in the order of the left rows, and the matches of one left row in the order of the right rows.
+ * callback(leftIterator, rightIterator) is called for each output pair. rightIterator is rightLast for the
+ * unmatched left rows of an outer join.
+ * @return The callback, as std::for_each does.
+ */
+template <typename LeftIterator, typename RightIterator, typename Compare, typename Callback>
+inline Callback TimMergeJoin(
+        LeftIterator leftFirst, LeftIterator leftLast, RightIterator rightFirst, RightIterator rightLast,
+        TimJoinType joinType, Compare comp, Callback callback);
+
+/**
+ * The same as TimMergeJoin, but collect the output pairs as positions in the (sorted) tables.
+ * The right position of an unmatched left row is kTimJoinNoMatch.
+ */
+template <typename LeftIterator, typename RightIterator, typename Compare>
+inline void TimMergeJoin(
+        LeftIterator leftFirst, LeftIterator leftLast, RightIterator rightFirst, RightIterator rightLast,
+        TimJoinType joinType, Compare comp, std::vector<std::pair<size_t, size_t> > &pairs);
+
+static const size_t kTimJoinNoMatch = static_cast<size_t>(-1);
+
+// ==================
+// Implementation
+// ==================
+
+class TimMergeJoinImpl
+{
+public:
+    template <typename LeftIterator, typename RightIterator, typename Compare, typename Callback>
+    static Callback Join(
+            LeftIterator leftFirst, LeftIterator leftLast, RightIterator rightFirst, RightIterator rightLast,
+            TimJoinType joinType, Compare comp, Callback callback);
+
+    /**
+     * Sort the table unless it is sorted already.
+     * One run detection pass tells whether the table is one run. If not, that run is reused as the sorted prefix.
+     */
+    template <typename RandomAccessIterator, typename Compare>
+    static void EnsureSorted(RandomAccessIterator first, RandomAccessIterator last, Compare comp);
+
+    /**
+     * Collect the output pairs of a join as positions relative to the first rows of both tables.
+     */
+    template <typename LeftIterator, typename RightIterator>
+    class PairCollector
+    {
+    public:
+        PairCollector(
+                LeftIterator leftFirst, RightIterator rightFirst, RightIterator rightLast,
+                std::vector<std::pair<size_t, size_t> > &pairs)
+            : mLeftFirst(leftFirst), mRightFirst(rightFirst), mRightLast(rightLast), mPairs(&pairs)
+        {
+        }
+
+        void operator()(LeftIterator left, RightIterator right)
+        {
+            size_t rightPos = right == mRightLast ? kTimJoinNoMatch : static_cast<size_t>(right - mRightFirst);
+            mPairs->push_back(std::make_pair(static_cast<size_t>(left - mLeftFirst), rightPos));
+        }
+
+    private:
+        LeftIterator mLeftFirst;
+        RightIterator mRightFirst;
+        RightIterator mRightLast;
+        std::vector<std::pair<size_t, size_t> > *mPairs;
+    };
+};
+
+template <typename RandomAccessIterator, typename Compare>
+void TimMergeJoinImpl::EnsureSorted(RandomAccessIterator first, RandomAccessIterator last, Compare comp)
+{
+    RandomAccessIterator runLast = TimSortDetail::DetectRunAndMakeAscending(first, last, comp);
+    if (runLast < last) {
+        TimSortDetail::SortAppended(first, runLast, last, comp);
+    }
+}
+
+template <typename LeftIterator, typename RightIterator, typename Compare, typename Callback>
+Callback TimMergeJoinImpl::Join(
+        LeftIterator leftFirst, LeftIterator leftLast, RightIterator rightFirst, RightIterator rightLast,
+        TimJoinType joinType, Compare comp, Callback callback)
+{
+    assert(leftFirst <= leftLast && rightFirst <= rightLast);
+
+    EnsureSorted(leftFirst, leftLast, comp);
+    EnsureSorted(rightFirst, rightLast, comp);
+
+    LeftIterator left = leftFirst;
+    RightIterator right = rightFirst;
+    while (left < leftLast && right < rightLast) {
+        if (comp(*left, *right)) {
+            // The left rows before the key of the current right row have no match. Skip them in one gallop.
+            LeftIterator p = TimSortDetail::GallopLeft(left, leftLast, left, *right, comp);
+            if (joinType == kTimLeftOuterJoin) {
+                for (; left < p; ++left) {
+                    callback(left, rightLast);
+                }
+            }
+            left = p;
+        } else if (comp(*right, *left)) {
+            right = TimSortDetail::GallopLeft(right, rightLast, right, *left, comp);
+        } else {
+            // Both groups of rows with this key. Every left row of the group matches every right row of the group.
+            LeftIterator leftGroupLast = TimSortDetail::GallopRight(left, leftLast, left, *right, comp);
+            RightIterator rightGroupLast = TimSortDetail::GallopRight(right, rightLast, right, *left, comp);
+            for (; left < leftGroupLast; ++left) {
+                if (joinType == kTimSemiJoin) {
+                    callback(left, right);
+                    continue;
+                }
+                for (RightIterator match = right; match < rightGroupLast; ++match) {
+                    callback(left, match);
+                }
+            }
+            right = rightGroupLast;
+        }
+    }
+
+    if (joinType == kTimLeftOuterJoin) {
+        for (; left < leftLast; ++left) {
+            callback(left, rightLast);
+        }
+    }
+
+    return callback;
+}
+
+template <typename LeftIterator, typename RightIterator, typename Compare, typename Callback>
+inline Callback TimMergeJoin(
+        LeftIterator leftFirst, LeftIterator leftLast, RightIterator rightFirst, RightIterator rightLast,
+        TimJoinType joinType, Compare comp, Callback callback)
+{
+    return TimMergeJoinImpl::Join(leftFirst, leftLast, rightFirst, rightLast, joinType, comp, callback);
+}
+
+template <typename LeftIterator, typename RightIterator, typename Compare>
+inline void TimMergeJoin(
+        LeftIterator leftFirst, LeftIterator leftLast, RightIterator rightFirst, RightIterator rightLast,
+        TimJoinType joinType, Compare comp, std::vector<std::pair<size_t, size_t> > &pairs)
+{
+    TimMergeJoinImpl::PairCollector<LeftIterator, RightIterator> collector(leftFirst, rightFirst, rightLast, pairs);
+    TimMergeJoinImpl::Join(leftFirst, leftLast, rightFirst, rightLast, joinType, comp, collector);
+}
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmarks of the kernels of TimSort, in ticks per element.
+// Usage: timsort_kernel_bench [num_elems]
+// The ticks are read by the clock of the phase timers: TSC cycles on x86, nanoseconds elsewhere. The rows name the
+// unit of the host.
+// The hardware counters are reported per element where the host allows perf events.
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <climits>
+#include <stdint.h>
+#include "timsort.h"
+#include "timsort_perf_counters.h"
+
+using namespace std;
+
+typedef vector<int>::iterator Iterator;
+
+template <typename T>
+string ToString(T t)
+{
+    stringstream s;
+    s << t;
+    return s.str();
+}
+
+// The results are added up here, so that the compiler cannot drop the measured calls.
+static volatile uint64_t gSink = 0;
+
+// The hardware counters of the measured regions since the last report.
+static TimSortPerfCounters gCounters;
+
+struct TimSortKernelBench
+{
+    static void BenchGallop(size_t numElems);
+    static void BenchMerge(size_t numElems);
+    static void BenchBinaryInsertionSort(size_t numElems);
+    static void BenchDetectRun(size_t numElems);
+    static void BenchCalcMinRunLength(size_t numElems);
+
+    // Start a measured region, and return its start tick.
+    static uint64_t StartMeasure()
+    {
+        gCounters.Start();
+        return TimSortDetail::ReadPhaseClock();
+    }
+
+    // End the measured region, and return its ticks.
+    static uint64_t StopMeasure(uint64_t start)
+    {
+        uint64_t ticks = TimSortDetail::ReadPhaseClock() - start;
+        gCounters.Stop();
+        return ticks;
+    }
+
+    // Report the ticks and the counters of the regions measured since the last report.
+    static void Report(const string &kernel, const string &params, uint64_t ticks, size_t numElems)
+    {
+        const char *unit = TimSortPhaseTimes::GetPlatformTickUnit() == kTimTickCycles ? " cycles/elem" : " ns/elem";
+        numElems = max<size_t>(numElems, 1);
+        cout << setw(28) << kernel << setw(28) << params
+             << setw(12) << fixed << setprecision(2) << static_cast<double>(ticks) / numElems << unit;
+
+        for (int event = 0; event < TimSortPerfCounters::kNumEvents; ++event) {
+            TimSortPerfCounters::Event e = static_cast<TimSortPerfCounters::Event>(event);
+            if (gCounters.IsCounted(e)) {
+                cout << setw(10) << setprecision(3) << static_cast<double>(gCounters.Get(e)) / numElems
+                     << " " << TimSortPerfCounters::GetName(e);
+            } else if (gCounters.IsAvailable(e)) {
+                cout << setw(10) << "n/a" << " " << TimSortPerfCounters::GetName(e);
+            }
+        }
+        cout << endl;
+        gCounters.Clear();
+    }
+
+    // Fill v with numElems random values in [0, INT_MAX).
+    static void MakeRandom(size_t numElems, vector<int> &v)
+    {
+        v.resize(numElems);
+        for (size_t i = 0; i < numElems; ++i) {
+            v[i] = rand() >> 1;
+        }
+    }
+};
+
+// One search per element, for a value at the given distance from the hint.
+void TimSortKernelBench::BenchGallop(size_t numElems)
+{
+    const size_t kNumSearches = 100000;
+
+    vector<int> v(numElems);
+    for (size_t i = 0; i < numElems; ++i) {
+        v[i] = 2 * i;
+    }
+    std::less<int> comp;
+
+    for (size_t distance = 1; distance < numElems; distance *= 4) {
+        // The hints and the values, drawn so that each value is found distance elements after its hint.
+        vector<size_t> hints(kNumSearches);
+        vector<int> values(kNumSearches);
+        for (size_t i = 0; i < kNumSearches; ++i) {
+            hints[i] = rand() % (numElems - distance);
+            values[i] = 2 * (hints[i] + distance) - 1;
+        }
+
+        string params = "distance " + ToString(distance);
+        uint64_t sum = 0;
+        uint64_t start = StartMeasure();
+        for (size_t i = 0; i < kNumSearches; ++i) {
+            sum += TimSortDetail::GallopLeft(v.begin(), v.end(), v.begin() + hints[i], values[i], comp) - v.begin();
+        }
+        Report("GallopLeft", params, StopMeasure(start), kNumSearches);
+
+        start = StartMeasure();
+        for (size_t i = 0; i < kNumSearches; ++i) {
+            sum += lower_bound(v.begin(), v.end(), values[i], comp) - v.begin();
+        }
+        Report("std::lower_bound", params, StopMeasure(start), kNumSearches);
+
+        start = StartMeasure();
+        for (size_t i = 0; i < kNumSearches; ++i) {
+            sum += TimSortDetail::GallopRight(v.begin(), v.end(), v.begin() + hints[i], values[i], comp) - v.begin();
+        }
+        Report("GallopRight", params, StopMeasure(start), kNumSearches);
+
+        start = StartMeasure();
+        for (size_t i = 0; i < kNumSearches; ++i) {
+            sum += upper_bound(v.begin(), v.end(), values[i], comp) - v.begin();
+        }
+        Report("std::upper_bound", params, StopMeasure(start), kNumSearches);
+
+        gSink += sum;
+    }
+}
+
+// Merge a run A with a run B of ratio times its length, or the converse.
+void TimSortKernelBench::BenchMerge(size_t numElems)
+{
+    const char *patterns[] = { "interleaved", "blocks" };
+    const size_t ratios[] = { 1, 4, 16, 64 };
+    std::less<int> comp;
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); ++p) {
+        for (size_t r = 0; r < sizeof(ratios) / sizeof(ratios[0]); ++r) {
+            for (int isLow = 1; isLow >= 0; --isLow) {
+                size_t shortLength = numElems / (ratios[r] + 1);
+                if (shortLength < 2) {
+                    // MergeLow and MergeHigh need two elements in each run after trimming.
+                    continue;
+                }
+                size_t lengthA = isLow ? shortLength : numElems - shortLength;
+
+                vector<int> input;
+                MakeRandom(numElems, input);
+                if (string(patterns[p]) == "blocks") {
+                    // The runs take turns in blocks of consecutive values, 64 of the short run and 64 * ratio of
+                    // the long one.
+                    size_t blockA = isLow ? 64 : 64 * ratios[r];
+                    size_t blockB = isLow ? 64 * ratios[r] : 64;
+                    for (size_t i = 0; i < lengthA; ++i) {
+                        input[i] = static_cast<int>(i / blockA * (blockA + blockB) + i % blockA);
+                    }
+                    for (size_t j = 0; j < numElems - lengthA; ++j) {
+                        input[lengthA + j] = static_cast<int>(j / blockB * (blockA + blockB) + blockA + j % blockB);
+                    }
+                }
+                sort(input.begin(), input.begin() + lengthA);
+                sort(input.begin() + lengthA, input.end());
+
+                // The runs as MergeAt passes them after trimming: B starts before A, and A ends after B.
+                input[lengthA] = -1;
+                input[lengthA - 1] = INT_MAX;
+
+                TimSortDetail::MergeState<Iterator> state(numElems);
+                state.EnsureMergeAreaSize(numElems / 2 + 1);
+                vector<int> v;
+                uint64_t ticks = 0;
+                size_t numReps = max<size_t>(1, 10000000 / numElems);
+                for (size_t rep = 0; rep < numReps; ++rep) {
+                    v = input;
+                    state.mMinGallop = TimSortDetail::kMinGallop;
+                    uint64_t start = StartMeasure();
+                    if (isLow) {
+                        TimSortDetail::MergeLow(state, v.begin(), v.begin() + lengthA, v.begin() + lengthA, v.end(), comp);
+                    } else {
+                        TimSortDetail::MergeHigh(state, v.begin(), v.begin() + lengthA, v.begin() + lengthA, v.end(), comp);
+                    }
+                    ticks += StopMeasure(start);
+                }
+                gSink += v[numElems / 2];
+
+                string params = string(patterns[p]) + (isLow ? " A:B 1:" : " A:B ") + ToString(ratios[r]) +
+                                (isLow ? "" : ":1");
+                Report(isLow ? "MergeLow" : "MergeHigh", params, ticks, numReps * numElems);
+            }
+        }
+    }
+}
+
+// Sort consecutive chunks of random values, one chunk per run boosted to minrun.
+void TimSortKernelBench::BenchBinaryInsertionSort(size_t numElems)
+{
+    vector<int> input;
+    MakeRandom(numElems, input);
+    std::less<int> comp;
+
+    for (size_t minRun = 16; minRun <= 64; minRun += 16) {
+        size_t numChunks = numElems / minRun;
+        vector<int> v = input;
+        uint64_t start = StartMeasure();
+        for (size_t i = 0; i < numChunks; ++i) {
+            TimSortDetail::BinaryInsertionSort(v.begin() + i * minRun, v.begin() + (i + 1) * minRun, comp);
+        }
+        Report("BinaryInsertionSort", "minrun " + ToString(minRun), StopMeasure(start),
+               numChunks * minRun);
+        gSink += v[0];
+    }
+}
+
+// Detect all runs of an ascending, a descending and a random range.
+void TimSortKernelBench::BenchDetectRun(size_t numElems)
+{
+    const char *patterns[] = { "ascending", "descending", "random" };
+    std::less<int> comp;
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); ++p) {
+        vector<int> v;
+        MakeRandom(numElems, v);
+        if (p == 0) {
+            sort(v.begin(), v.end());
+        } else if (p == 1) {
+            sort(v.begin(), v.end(), greater<int>());
+        }
+
+        size_t numRuns = 0;
+        uint64_t start = StartMeasure();
+        for (Iterator first = v.begin(); first < v.end(); ++numRuns) {
+            first = TimSortDetail::DetectRunAndMakeAscending(first, v.end(), comp);
+        }
+        Report("DetectRunAndMakeAscending", patterns[p], StopMeasure(start), numElems);
+        gSink += numRuns;
+    }
+}
+
+// One call per element, over consecutive sizes.
+void TimSortKernelBench::BenchCalcMinRunLength(size_t numElems)
+{
+    uint64_t sum = 0;
+    uint64_t start = StartMeasure();
+    for (size_t n = 1; n <= numElems; ++n) {
+        sum += TimSortDetail::CalcMinRunLength(n);
+    }
+    Report("CalcMinRunLength", "n in [1, num_elems]", StopMeasure(start), numElems);
+    gSink += sum;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t numElems = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    if (numElems == 0) {
+        cerr << "Usage: timsort_kernel_bench [num_elems], with num_elems > 0" << endl;
+        return 1;
+    }
+
+    srand(2011);
+    cout << "num elems: " << numElems << endl;
+    if (gCounters.GetError().empty() == false) {
+        cerr << "Some perf counters are not reported, " << gCounters.GetError() << endl;
+    }
+
+    TimSortKernelBench::BenchGallop(numElems);
+    TimSortKernelBench::BenchMerge(numElems);
+    TimSortKernelBench::BenchBinaryInsertionSort(numElems);
+    TimSortKernelBench::BenchDetectRun(numElems);
+    TimSortKernelBench::BenchCalcMinRunLength(numElems);
+
+    return 0;
+}
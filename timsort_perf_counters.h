@@ -0,0 +1,250 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMSORT_PERF_COUNTERS_H
+#define TIMSORT_PERF_COUNTERS_H
+
+// Hardware performance counters of the calling thread for the benchmarks, read by perf_event_open on Linux.
+
+#include <string>
+#include <cstring>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+/**
+ * Count hardware events around measured regions.
+ *
+ * The events are opened as one group, so that the kernel schedules them on the PMU together and their ratios
+ * come from the same instructions. An event that the group cannot take is opened on its own instead, and one
+ * that cannot be opened at all, e.g. on a virtual machine without a PMU or under a kernel.perf_event_paranoid
+ * that forbids it, is not available and reads 0. Off Linux none is available.
+ *
+ * Start and Stop may enclose several regions: the counts add up until Clear. They are scaled for multiplexing
+ * when the kernel could not keep an event on the PMU all the time. An event that the kernel accepted but never
+ * put on the PMU in a region, e.g. when the NMI watchdog holds a counter the group needs, is not counted until Clear.
+ */
+class TimSortPerfCounters
+{
+public:
+    enum Event
+    {
+        kCycles,
+        kInstructions,
+        kBranchMisses,
+        kL1dMisses,     // L1 data cache read misses
+        kLlcMisses,     // Last level cache misses
+        kDtlbMisses,    // Data TLB read misses
+        kNumEvents
+    };
+
+    TimSortPerfCounters();
+
+    ~TimSortPerfCounters();
+
+    bool IsAvailable(Event event) const { return mFds[event] >= 0; }
+
+    bool IsAnyAvailable() const;
+
+    // Whether the event is available and was counted in all the regions since Clear, so that Get is a measure.
+    bool IsCounted(Event event) const { return IsAvailable(event) && mIsMissed[event] == false; }
+
+    // Why the first unavailable event could not be opened, or empty.
+    const std::string &GetError() const { return mError; }
+
+    static const char *GetName(Event event);
+
+    void Clear();
+
+    void Start();
+
+    void Stop();
+
+    uint64_t Get(Event event) const { return mCounts[event]; }
+
+private:
+    // Not copyable, it owns the file descriptors.
+    TimSortPerfCounters(const TimSortPerfCounters &);
+    TimSortPerfCounters &operator=(const TimSortPerfCounters &);
+
+    int mFds[kNumEvents];
+    int mLeaderFd;                  // The group leader, or -1
+    bool mIsInGroup[kNumEvents];
+    // The times the kernel reported at the last Stop. They are not reset with the counts, so the scaling of a
+    // region needs their deltas.
+    uint64_t mTimeEnabled[kNumEvents];
+    uint64_t mTimeRunning[kNumEvents];
+    bool mIsMissed[kNumEvents];     // Enabled but never running in a region since Clear
+    uint64_t mCounts[kNumEvents];
+    std::string mError;
+};
+
+inline const char *TimSortPerfCounters::GetName(Event event)
+{
+    static const char *names[kNumEvents] = { "cycles", "instrs", "br-miss", "L1d-miss", "LLC-miss", "dTLB-miss" };
+    return names[event];
+}
+
+inline bool TimSortPerfCounters::IsAnyAvailable() const
+{
+    for (int event = 0; event < kNumEvents; ++event) {
+        if (IsAvailable(static_cast<Event>(event))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void TimSortPerfCounters::Clear()
+{
+    memset(mCounts, 0, sizeof(mCounts));
+    for (int event = 0; event < kNumEvents; ++event) {
+        mIsMissed[event] = false;
+    }
+}
+
+#ifdef __linux__
+
+inline TimSortPerfCounters::TimSortPerfCounters() : mLeaderFd(-1)
+{
+    static const uint32_t types[kNumEvents] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HW_CACHE
+    };
+    static const uint64_t configs[kNumEvents] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+
+    for (int event = 0; event < kNumEvents; ++event) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[event];
+        attr.config = configs[event];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // This thread, on any CPU, in the group if it takes the event.
+        mFds[event] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, mLeaderFd, 0));
+        mIsInGroup[event] = mFds[event] >= 0;
+        if (mFds[event] < 0 && mLeaderFd >= 0) {
+            mFds[event] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+        if (mLeaderFd < 0) {
+            mLeaderFd = mFds[event];
+        }
+        mTimeEnabled[event] = 0;
+        mTimeRunning[event] = 0;
+        if (mFds[event] < 0 && mError.empty()) {
+            mError = std::string(GetName(static_cast<Event>(event))) + ": " + strerror(errno);
+        }
+    }
+
+    Clear();
+}
+
+inline TimSortPerfCounters::~TimSortPerfCounters()
+{
+    for (int event = 0; event < kNumEvents; ++event) {
+        if (mFds[event] >= 0) {
+            close(mFds[event]);
+        }
+    }
+}
+
+inline void TimSortPerfCounters::Start()
+{
+    for (int event = 0; event < kNumEvents; ++event) {
+        if (mFds[event] >= 0 && mIsInGroup[event] == false) {
+            ioctl(mFds[event], PERF_EVENT_IOC_RESET, 0);
+            ioctl(mFds[event], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    // The group is enabled last and disabled first, the nearest to the measured region.
+    if (mLeaderFd >= 0) {
+        ioctl(mLeaderFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(mLeaderFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+inline void TimSortPerfCounters::Stop()
+{
+    if (mLeaderFd >= 0) {
+        ioctl(mLeaderFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+    for (int event = 0; event < kNumEvents; ++event) {
+        if (mFds[event] >= 0 && mIsInGroup[event] == false) {
+            ioctl(mFds[event], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    for (int event = 0; event < kNumEvents; ++event) {
+        // The value since the reset, and the time enabled and the time running since the open.
+        uint64_t values[3];
+        if (mFds[event] < 0 || read(mFds[event], values, sizeof(values)) != static_cast<ssize_t>(sizeof(values))) {
+            continue;
+        }
+        uint64_t enabled = values[1] - mTimeEnabled[event];
+        uint64_t running = values[2] - mTimeRunning[event];
+        mTimeEnabled[event] = values[1];
+        mTimeRunning[event] = values[2];
+        if (enabled > 0 && running == 0) {
+            // The count of 0 is not a measure.
+            mIsMissed[event] = true;
+            continue;
+        }
+        if (running < enabled) {
+            values[0] = static_cast<uint64_t>(static_cast<double>(values[0]) * enabled / running);
+        }
+        mCounts[event] += values[0];
+    }
+}
+
+#else
+
+inline TimSortPerfCounters::TimSortPerfCounters() : mLeaderFd(-1), mError("perf events need Linux")
+{
+    for (int event = 0; event < kNumEvents; ++event) {
+        mFds[event] = -1;
+        mIsInGroup[event] = false;
+        mTimeEnabled[event] = 0;
+        mTimeRunning[event] = 0;
+    }
+    Clear();
+}
+
+inline TimSortPerfCounters::~TimSortPerfCounters() {}
+
+inline void TimSortPerfCounters::Start() {}
+
+inline void TimSortPerfCounters::Stop() {}
+
+#endif
+
+#endif
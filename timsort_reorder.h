@@ -0,0 +1,156 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMSORT_REORDER_H
+#define TIMSORT_REORDER_H
+
+#include <stdint.h>
+#include "timsort_streaming.h"
+
+// What TimSortReorderBuffer does with an event not greater than the last watermark, i.e. one that arrives
+// after events greater than it were emitted.
+enum TimLatePolicy
+{
+    kTimDropLate,    // Discard it
+    kTimAdmitLate    // Buffer it and emit it with the next watermark, out of order with the events emitted before
+};
+
+struct TimSortReorderStats
+{
+    uint64_t mNumPushed;         // Events accepted into the buffer, late ones included
+    uint64_t mNumEmitted;        // Events emitted
+    uint64_t mNumEmits;          // Calls of Emit and Flush
+    uint64_t mNumLateDropped;    // Late events discarded by kTimDropLate
+    uint64_t mNumLateAdmitted;   // Late events buffered by kTimAdmitLate
+    uint64_t mNumRejected;       // Events refused because the buffer was full
+    size_t mPeakSize;            // The largest number of buffered events
+
+    TimSortReorderStats()
+        : mNumPushed(0), mNumEmitted(0), mNumEmits(0), mNumLateDropped(0), mNumLateAdmitted(0), mNumRejected(0),
+          mPeakSize(0)
+    {
+    }
+};
+
+/**
+ * Reorder out-of-order events and emit them in sorted order as a watermark advances.
+ *
+ * Events are pushed into a StreamingTimSort, which keeps them as sorted runs with the usual run boosting and merging.
+ * Emit(watermark) pops the events not greater than the watermark: it merges the prefixes of the runs up to it,
+ * and never sorts the whole buffer. Within one emission equal events keep their arrival order.
+ *
+ * The buffer holds at most capacity events. Push refuses events beyond it, so the caller must advance the watermark
+ * to make room. The storage of 2 * capacity events is reserved up front: the emitted events stay behind as a dead
+ * prefix until it is half of the storage, so an emission moves only the events left between the runs' prefixes.
+ */
+template <typename T, typename Compare = std::less<T> >
+class TimSortReorderBuffer
+{
+public:
+    explicit TimSortReorderBuffer(size_t capacity, TimLatePolicy latePolicy = kTimDropLate, Compare comp = Compare())
+        : mSorter(comp), mComp(comp), mCapacity(capacity), mLatePolicy(latePolicy), mHasWatermark(false)
+    {
+        mSorter.Reserve(2 * capacity);
+    }
+
+    /**
+     * @return false if the event was dropped as late or refused because the buffer is full.
+     */
+    bool Push(const T &value);
+
+    /**
+     * Emit the buffered events not greater than watermark to out in sorted order.
+     * A watermark less than the last one is ignored, the watermarks only advance.
+     * @return The end of the output range.
+     */
+    template <typename OutputIterator>
+    OutputIterator Emit(const T &watermark, OutputIterator out);
+
+    /**
+     * Emit all buffered events in sorted order, e.g. at the end of the stream. The watermark is kept.
+     * @return The end of the output range.
+     */
+    template <typename OutputIterator>
+    OutputIterator Flush(OutputIterator out);
+
+    size_t Size() const { return mSorter.Size(); }
+
+    size_t Capacity() const { return mCapacity; }
+
+    const TimSortReorderStats &GetStats() const { return mStats; }
+
+private:
+    StreamingTimSort<T, Compare> mSorter;
+    Compare mComp;
+    size_t mCapacity;
+    TimLatePolicy mLatePolicy;
+
+    bool mHasWatermark;
+    T mWatermark;
+
+    TimSortReorderStats mStats;
+};
+
+template <typename T, typename Compare>
+bool TimSortReorderBuffer<T, Compare>::Push(const T &value)
+{
+    if (mSorter.Size() >= mCapacity) {
+        ++mStats.mNumRejected;
+        return false;
+    }
+
+    if (mHasWatermark && mComp(mWatermark, value) == false) {
+        if (mLatePolicy == kTimDropLate) {
+            ++mStats.mNumLateDropped;
+            return false;
+        }
+        ++mStats.mNumLateAdmitted;
+    }
+
+    mSorter.Push(value);
+    ++mStats.mNumPushed;
+    mStats.mPeakSize = std::max(mStats.mPeakSize, mSorter.Size());
+    return true;
+}
+
+template <typename T, typename Compare>
+template <typename OutputIterator>
+OutputIterator TimSortReorderBuffer<T, Compare>::Emit(const T &watermark, OutputIterator out)
+{
+    if (mHasWatermark == false || mComp(mWatermark, watermark)) {
+        mWatermark = watermark;
+        mHasWatermark = true;
+    }
+
+    size_t size = mSorter.Size();
+    out = mSorter.PopUpTo(mWatermark, out);
+    mStats.mNumEmitted += size - mSorter.Size();
+    ++mStats.mNumEmits;
+    return out;
+}
+
+template <typename T, typename Compare>
+template <typename OutputIterator>
+OutputIterator TimSortReorderBuffer<T, Compare>::Flush(OutputIterator out)
+{
+    mStats.mNumEmitted += mSorter.Size();
+    ++mStats.mNumEmits;
+    out = mSorter.Finish(out);
+    mSorter.Clear();
+    return out;
+}
+
+#endif
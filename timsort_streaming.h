@@ -0,0 +1,355 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMSORT_STREAMING_H
+#define TIMSORT_STREAMING_H
+
+#include <vector>
+#include "timsort.h"
+
+/**
+ * Sort elements as they are produced.
+ *
+ * Every pushed element extends the current run. A natural run (ascending, or strictly descending) grows as long
+ * as the input keeps its order. A run that breaks before the minrun length is boosted by inserting each further
+ * element with binary insertion until it reaches minrun. Complete runs are pushed to the merge stack and merged
+ * by the TimSort stack rules right away, so Finish() only has to merge the few runs left in the stack.
+ *
+ * The memory used is the pushed elements plus TimSort's merge area, at most half of them. PopUpTo() leaves the popped
+ * elements as a dead prefix of the storage, which a full storage reuses once the prefix is half of it; otherwise the
+ * storage doubles. The memory is not capped. A caller that needs a bound of n elements reserves 2n with Reserve()
+ * and stops pushing at n, as TimSortReorderBuffer does: a full storage then always has half of it dead.
+ * Elements can still be pushed after Finish(). The next Finish() merges them with the sorted ones, and Next()
+ * starts over from the first of them.
+ */
+template <typename T, typename Compare = std::less<T> >
+class StreamingTimSort
+{
+public:
+    explicit StreamingTimSort(Compare comp = Compare())
+        : mComp(comp), mMergeState(0), mHead(0), mRunFirst(0), mRunOrder(kRunEmpty), mCursor(0)
+    {
+    }
+
+    void Push(const T &value);
+
+    template <typename InputIterator>
+    void PushRange(InputIterator first, InputIterator last)
+    {
+        for (; first != last; ++first) {
+            Push(*first);
+        }
+    }
+
+    /**
+     * Merge all runs. After this the pushed elements are sorted and can be pulled by Next().
+     */
+    void Finish();
+
+    /**
+     * Finish the sort and copy the sorted elements to out.
+     * @return The end of the output range.
+     */
+    template <typename OutputIterator>
+    OutputIterator Finish(OutputIterator out)
+    {
+        Finish();
+        return std::copy(mData.begin() + mHead, mData.end(), out);
+    }
+
+    /**
+     * Pull the next sorted element after Finish().
+     * @return false if all elements have been pulled.
+     */
+    bool Next(T &value)
+    {
+        if (mCursor >= mData.size()) {
+            return false;
+        }
+        value = mData[mCursor++];
+        return true;
+    }
+
+    /**
+     * Remove the elements not greater than bound and write them to out in stable sorted order.
+     * Only the prefixes of the runs up to bound are merged. The rest of the runs stay sorted: the longest stays in place
+     * and the others close the gaps up to it, and only the merges the stack rules require are done.
+     * @return The end of the output range.
+     */
+    template <typename OutputIterator>
+    OutputIterator PopUpTo(const T &bound, OutputIterator out);
+
+    size_t Size() const { return mData.size() - mHead; }
+
+    /**
+     * Make room for capacity elements in the storage, the dead prefix left by PopUpTo() included.
+     */
+    void Reserve(size_t capacity);
+
+    void Clear();
+
+private:
+    typedef typename std::vector<T>::iterator Iterator;
+
+    // The order of the run being formed at the end of mData.
+    enum RunOrder
+    {
+        kRunEmpty,        // No element yet
+        kRunSingle,       // One element, the order is not known yet
+        kRunAscending,    // A natural non-descending run
+        kRunDescending,   // A natural strictly descending run, reversed when it is complete
+        kRunBoosted       // A short run extended by binary insertion up to minrun
+    };
+
+    // Push the run [mRunFirst, end of mData) to the merge stack and start a new one.
+    void PushRun();
+
+    // Move the elements down over the dead prefix.
+    void Compact();
+
+    Compare mComp;
+    std::vector<T> mData;
+    TimSortDetail::MergeState<Iterator> mMergeState;
+
+    size_t mHead;        // The first element not popped yet. The elements before it are dead.
+    size_t mRunFirst;    // The first element of the run being formed
+    RunOrder mRunOrder;
+    size_t mCursor;      // The next element returned by Next()
+};
+
+template <typename T, typename Compare>
+void StreamingTimSort<T, Compare>::Push(const T &value)
+{
+    const size_t minRunLength = TimSortDetail::kMaxMinRunLength;
+
+    if (mData.size() == mData.capacity()) {
+        // Reuse the dead prefix once it is half of the storage, so that the moves are amortized over the pops.
+        if (mHead > 0 && 2 * mHead >= mData.size()) {
+            Compact();
+        } else {
+            Reserve(std::max(2 * mData.capacity(), minRunLength));
+        }
+    }
+
+    size_t runLength = mData.size() - mRunFirst;
+
+    switch (mRunOrder) {
+    case kRunEmpty:
+        mData.push_back(value);
+        mRunOrder = kRunSingle;
+        return;
+    case kRunSingle:
+        mRunOrder = mComp(value, mData.back()) ? kRunDescending : kRunAscending;
+        mData.push_back(value);
+        return;
+    case kRunAscending:
+        if (mComp(value, mData.back()) == false) {
+            mData.push_back(value);
+            return;
+        }
+        break;
+    case kRunDescending:
+        if (mComp(value, mData.back())) {
+            mData.push_back(value);
+            return;
+        }
+        TimSortDetail::ReverseRun(mData.begin() + mRunFirst, mData.end());
+        mRunOrder = kRunAscending;
+        break;
+    case kRunBoosted:
+        break;
+    }
+
+    // The natural run is broken.
+    if (mRunOrder != kRunBoosted && runLength >= minRunLength) {
+        PushRun();
+        mData.push_back(value);
+        mRunOrder = kRunSingle;
+        return;
+    }
+
+    // Boost the run: insert the value into the sorted run [mRunFirst, end).
+    mRunOrder = kRunBoosted;
+    mData.push_back(value);
+    Iterator runFirst = mData.begin() + mRunFirst;
+    Iterator last = mData.end() - 1;
+    Iterator pos = std::upper_bound(runFirst, last, value, mComp);
+    std::copy_backward(pos, last, last + 1);
+    *pos = value;
+
+    if (runLength + 1 >= minRunLength) {
+        PushRun();
+    }
+}
+
+template <typename T, typename Compare>
+void StreamingTimSort<T, Compare>::PushRun()
+{
+    assert(mRunFirst < mData.size());
+
+    if (mRunOrder == kRunDescending) {
+        TimSortDetail::ReverseRun(mData.begin() + mRunFirst, mData.end());
+    }
+
+    TimSortDetail::Run<Iterator> run;
+    run.first = mData.begin() + mRunFirst;
+    run.last = mData.end();
+
+    assert(mMergeState.mNumRunInStack < TimSortDetail::kMaxMergeStackSize);
+    mMergeState.mStack[mMergeState.mNumRunInStack++] = run;
+    mMergeState.mArraySize = Size();
+    TimSortDetail::TryMerge(mMergeState, mComp);
+
+    mRunFirst = mData.size();
+    mRunOrder = kRunEmpty;
+}
+
+template <typename T, typename Compare>
+void StreamingTimSort<T, Compare>::Finish()
+{
+    if (mRunOrder != kRunEmpty) {
+        PushRun();
+    }
+
+    if (mMergeState.mNumRunInStack > 1) {
+        TimSortDetail::ForceMerge(mMergeState, mComp);
+    }
+    mCursor = mHead;
+}
+
+template <typename T, typename Compare>
+template <typename OutputIterator>
+OutputIterator StreamingTimSort<T, Compare>::PopUpTo(const T &bound, OutputIterator out)
+{
+    if (mRunOrder != kRunEmpty) {
+        PushRun();
+    }
+    if (mMergeState.mNumRunInStack == 0) {
+        return out;
+    }
+
+    // The popped elements are a prefix of each run.
+    std::vector<std::pair<Iterator, Iterator> > prefixes;
+    for (size_t i = 0; i < mMergeState.mNumRunInStack; ++i) {
+        TimSortDetail::Run<Iterator> &run = mMergeState.mStack[i];
+        prefixes.push_back(std::make_pair(run.first, TimSortDetail::GallopRight(run.first, run.last, run.first, bound, mComp)));
+    }
+    out = TimSortDetail::MergeK(prefixes, out, mComp);
+
+    // The rest of each run starts at the end of its prefix. The longest rest stays in place, the rests below it move up
+    // to it and the ones above move down to it, so no rest moves more than once.
+    size_t numRuns = mMergeState.mNumRunInStack;
+    size_t pivot = 0;
+    for (size_t i = 1; i < numRuns; ++i) {
+        if (mMergeState.mStack[i].last - prefixes[i].second > mMergeState.mStack[pivot].last - prefixes[pivot].second) {
+            pivot = i;
+        }
+    }
+
+    TimSortDetail::Run<Iterator> rests[TimSortDetail::kMaxMergeStackSize];
+    Iterator dest = prefixes[pivot].second;
+    for (size_t i = pivot; i-- > 0; ) {
+        Iterator last = mMergeState.mStack[i].last;
+        if (last != dest) {
+            std::copy_backward(prefixes[i].second, last, dest);
+        }
+        rests[i].last = dest;
+        dest -= last - prefixes[i].second;
+        rests[i].first = dest;
+    }
+    mHead = dest - mData.begin();
+
+    dest = prefixes[pivot].second;
+    for (size_t i = pivot; i < numRuns; ++i) {
+        Iterator last = mMergeState.mStack[i].last;
+        rests[i].first = dest;
+        dest = dest == prefixes[i].second ? last : std::copy(prefixes[i].second, last, dest);
+        rests[i].last = dest;
+    }
+    mData.erase(dest, mData.end());
+
+    // Push the rests back, dropping the empty ones. They are shorter than the runs were, so the stack rules may ask
+    // for some merges, but they are sorted already.
+    mMergeState.mNumRunInStack = 0;
+    mMergeState.mArraySize = Size();
+    for (size_t i = 0; i < numRuns; ++i) {
+        if (rests[i].first < rests[i].last) {
+            mMergeState.mStack[mMergeState.mNumRunInStack++] = rests[i];
+            TimSortDetail::TryMerge(mMergeState, mComp);
+        }
+    }
+
+    // Nothing is left to move once all is popped.
+    if (mHead == mData.size()) {
+        mData.clear();
+        mHead = 0;
+    }
+
+    mRunFirst = mData.size();
+    mCursor = mHead;
+    return out;
+}
+
+template <typename T, typename Compare>
+void StreamingTimSort<T, Compare>::Reserve(size_t capacity)
+{
+    if (capacity <= mData.capacity()) {
+        return;
+    }
+
+    // The runs in the merge stack point into mData. Rebase them if the storage moves.
+    size_t offsets[2 * TimSortDetail::kMaxMergeStackSize];
+    for (size_t i = 0; i < mMergeState.mNumRunInStack; ++i) {
+        offsets[2 * i] = mMergeState.mStack[i].first - mData.begin();
+        offsets[2 * i + 1] = mMergeState.mStack[i].last - mData.begin();
+    }
+
+    mData.reserve(capacity);
+
+    for (size_t i = 0; i < mMergeState.mNumRunInStack; ++i) {
+        mMergeState.mStack[i].first = mData.begin() + offsets[2 * i];
+        mMergeState.mStack[i].last = mData.begin() + offsets[2 * i + 1];
+    }
+}
+
+template <typename T, typename Compare>
+void StreamingTimSort<T, Compare>::Compact()
+{
+    std::copy(mData.begin() + mHead, mData.end(), mData.begin());
+    mData.erase(mData.end() - mHead, mData.end());
+
+    for (size_t i = 0; i < mMergeState.mNumRunInStack; ++i) {
+        mMergeState.mStack[i].first -= mHead;
+        mMergeState.mStack[i].last -= mHead;
+    }
+    mRunFirst -= mHead;
+    mCursor = mCursor > mHead ? mCursor - mHead : 0;
+    mHead = 0;
+}
+
+template <typename T, typename Compare>
+void StreamingTimSort<T, Compare>::Clear()
+{
+    mData.clear();
+    mHead = 0;
+    mMergeState.mNumRunInStack = 0;
+    mMergeState.mMinGallop = TimSortDetail::kMinGallop;
+    mRunFirst = 0;
+    mRunOrder = kRunEmpty;
+    mCursor = 0;
+}
+
+#endif
@@ -0,0 +1,286 @@
+/**
+ * Copyright 2011 Haoran Yang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMSORT_TREE_H
+#define TIMSORT_TREE_H
+
+#include <vector>
+#include <ostream>
+#include "timsort.h"
+
+// A run pushed to the stack or a merge of two nodes of the merge tree.
+struct TimSortMergeTreeNode
+{
+    static const size_t kNone = static_cast<size_t>(-1);
+
+    bool mIsMerge;
+    size_t mFirst;              // The position of the first element of the node in the sorted range
+    size_t mLength;
+
+    // Runs
+    size_t mNaturalLength;      // The length of the natural run, less than mLength if the run was boosted
+    bool mIsDescending;         // The natural run was descending and reversed
+
+    // Merges
+    size_t mLeft;               // The node ids of run A and run B
+    size_t mRight;
+    size_t mStackPos;           // The stack position of run A, and the number of runs in the stack before the merge
+    size_t mStackSize;
+    uint64_t mNumGallops;       // Entries into the galloping mode
+    uint64_t mNumGallopCompares;
+
+    // The comparisons and element moves of the run detection and boosting, or of the merge.
+    uint64_t mNumCompares;
+    uint64_t mNumBytesMoved;
+
+    TimSortMergeTreeNode()
+        : mIsMerge(false), mFirst(0), mLength(0), mNaturalLength(0), mIsDescending(false),
+          mLeft(kNone), mRight(kNone), mStackPos(0), mStackSize(0), mNumGallops(0), mNumGallopCompares(0),
+          mNumCompares(0), mNumBytesMoved(0)
+    {
+    }
+
+    // The share of the merge comparisons made in the galloping mode.
+    double GetGallopFraction() const
+    {
+        return mNumCompares == 0 ? 0.0 : static_cast<double>(mNumGallopCompares) / mNumCompares;
+    }
+};
+
+/**
+ * Record the merge tree of a sort, for tuning minrun and the merge policy offline.
+ *
+ * The tree is a TimSortHooks policy: TimSort(first, last, comp, tree) records the runs pushed to the stack as
+ * leaves and the merges as inner nodes, in the order they happen, so the node ids follow the TryMerge and ForceMerge
+ * decisions. Each sort replaces the tree of the previous one. A sort taken by the low cardinality path merges
+ * nothing and leaves the tree empty, unless the grouping gives up late: its grouped prefix is then the first leaf.
+ */
+template <typename RandomAccessIterator>
+class TimSortMergeTree : public TimSortHooks
+{
+public:
+    TimSortMergeTree() : mLength(0), mFinalMinGallop(0) { Clear(); }
+
+    void Clear();
+
+    const std::vector<TimSortMergeTreeNode> &GetNodes() const { return mNodes; }
+
+    /**
+     * @return The id of the node of the whole range, or TimSortMergeTreeNode::kNone if the tree is empty.
+     */
+    size_t GetRoot() const { return mStack.size() == 1 ? mStack[0] : static_cast<size_t>(TimSortMergeTreeNode::kNone); }
+
+    /**
+     * Write the tree as one JSON object: the sort parameters and the array of nodes, indexed by id.
+     */
+    void WriteJson(std::ostream &out) const;
+
+    /**
+     * Write the tree as a Graphviz digraph, with edges from each merge to its runs.
+     * The boosted runs are filled.
+     */
+    void WriteDot(std::ostream &out) const;
+
+    // The events of the sort.
+    void OnSortBegin(RandomAccessIterator first, RandomAccessIterator last);
+
+    void OnCompare();
+
+    void OnMove(size_t numElems);
+
+    void OnRunDetected(RandomAccessIterator first, RandomAccessIterator last, bool isDescending);
+
+    void OnRunPushed(RandomAccessIterator first, RandomAccessIterator last, size_t stackSize);
+
+    void OnMergeBegin(size_t stackPos, RandomAccessIterator firstA, RandomAccessIterator firstB, RandomAccessIterator lastB);
+
+    void OnMergeEnd(RandomAccessIterator first, RandomAccessIterator last);
+
+    void OnGallopEnter();
+
+    void OnGallopExit() { mIsGalloping = false; }
+
+    void OnSortEnd(size_t minGallop) { mFinalMinGallop = minGallop; }
+
+private:
+    static const size_t kElemSize = sizeof(typename RandomAccessIterator::value_type);
+
+    RandomAccessIterator mFirst;
+    size_t mLength;
+    size_t mFinalMinGallop;
+    std::vector<TimSortMergeTreeNode> mNodes;
+    std::vector<size_t> mStack;          // The node ids of the runs in the stack of the sort
+
+    TimSortMergeTreeNode mPendingRun;    // The run being detected and boosted
+    size_t mMerge;                       // The node id of the merge in progress, or kNone
+    bool mIsGalloping;
+};
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::Clear()
+{
+    mLength = 0;
+    mFinalMinGallop = 0;
+    mNodes.clear();
+    mStack.clear();
+    mPendingRun = TimSortMergeTreeNode();
+    mMerge = TimSortMergeTreeNode::kNone;
+    mIsGalloping = false;
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnSortBegin(RandomAccessIterator first, RandomAccessIterator last)
+{
+    Clear();
+    mFirst = first;
+    mLength = last - first;
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnCompare()
+{
+    if (mMerge == TimSortMergeTreeNode::kNone) {
+        ++mPendingRun.mNumCompares;
+        return;
+    }
+
+    TimSortMergeTreeNode &merge = mNodes[mMerge];
+    ++merge.mNumCompares;
+    merge.mNumGallopCompares += mIsGalloping;
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnMove(size_t numElems)
+{
+    TimSortMergeTreeNode &node = mMerge == TimSortMergeTreeNode::kNone ? mPendingRun : mNodes[mMerge];
+    node.mNumBytesMoved += numElems * kElemSize;
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnRunDetected(
+        RandomAccessIterator first, RandomAccessIterator last, bool isDescending)
+{
+    mPendingRun.mFirst = first - mFirst;
+    mPendingRun.mNaturalLength = last - first;
+    mPendingRun.mIsDescending = isDescending;
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnRunPushed(
+        RandomAccessIterator first, RandomAccessIterator last, size_t stackSize)
+{
+    assert(static_cast<size_t>(first - mFirst) == mPendingRun.mFirst && stackSize == mStack.size() + 1);
+
+    mPendingRun.mLength = last - first;
+    mStack.push_back(mNodes.size());
+    mNodes.push_back(mPendingRun);
+    mPendingRun = TimSortMergeTreeNode();
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnMergeBegin(
+        size_t stackPos, RandomAccessIterator firstA, RandomAccessIterator firstB, RandomAccessIterator lastB)
+{
+    assert(stackPos + 1 < mStack.size());
+
+    TimSortMergeTreeNode merge;
+    merge.mIsMerge = true;
+    merge.mFirst = firstA - mFirst;
+    merge.mLength = lastB - firstA;
+    merge.mLeft = mStack[stackPos];
+    merge.mRight = mStack[stackPos + 1];
+    merge.mStackPos = stackPos;
+    merge.mStackSize = mStack.size();
+    assert(mNodes[merge.mLeft].mLength == static_cast<size_t>(firstB - firstA));
+
+    // The same adjustment of the stack as MergeAt.
+    mMerge = mNodes.size();
+    mNodes.push_back(merge);
+    mStack[stackPos] = mMerge;
+    mStack.erase(mStack.begin() + stackPos + 1);
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnMergeEnd(RandomAccessIterator first, RandomAccessIterator last)
+{
+    assert(mMerge != TimSortMergeTreeNode::kNone && mNodes[mMerge].mLength == static_cast<size_t>(last - first));
+    mMerge = TimSortMergeTreeNode::kNone;
+    mIsGalloping = false;
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::OnGallopEnter()
+{
+    assert(mMerge != TimSortMergeTreeNode::kNone);
+    ++mNodes[mMerge].mNumGallops;
+    mIsGalloping = true;
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::WriteJson(std::ostream &out) const
+{
+    out << "{\"length\": " << mLength << ", \"elemSize\": " << kElemSize << ", \"finalMinGallop\": " << mFinalMinGallop;
+    if (GetRoot() == TimSortMergeTreeNode::kNone) {
+        out << ", \"root\": null";
+    } else {
+        out << ", \"root\": " << GetRoot();
+    }
+    out << ", \"nodes\": [";
+
+    for (size_t id = 0; id < mNodes.size(); ++id) {
+        const TimSortMergeTreeNode &node = mNodes[id];
+        out << (id == 0 ? "\n" : ",\n") << "  {\"id\": " << id
+            << ", \"type\": \"" << (node.mIsMerge ? "merge" : "run") << "\""
+            << ", \"first\": " << node.mFirst << ", \"length\": " << node.mLength;
+        if (node.mIsMerge) {
+            out << ", \"left\": " << node.mLeft << ", \"right\": " << node.mRight
+                << ", \"stackPos\": " << node.mStackPos << ", \"stackSize\": " << node.mStackSize
+                << ", \"gallops\": " << node.mNumGallops << ", \"gallopFraction\": " << node.GetGallopFraction();
+        } else {
+            out << ", \"origin\": \"" << (node.mLength > node.mNaturalLength ? "boosted" : "natural") << "\""
+                << ", \"naturalLength\": " << node.mNaturalLength
+                << ", \"descending\": " << (node.mIsDescending ? "true" : "false");
+        }
+        out << ", \"compares\": " << node.mNumCompares << ", \"bytesMoved\": " << node.mNumBytesMoved << "}";
+    }
+
+    out << "\n]}\n";
+}
+
+template <typename RandomAccessIterator>
+void TimSortMergeTree<RandomAccessIterator>::WriteDot(std::ostream &out) const
+{
+    out << "digraph timsort {\n";
+    out << "  node [shape=box, fontsize=10];\n";
+
+    for (size_t id = 0; id < mNodes.size(); ++id) {
+        const TimSortMergeTreeNode &node = mNodes[id];
+        out << "  n" << id << " [label=\"#" << id << " [" << node.mFirst << ", " << node.mFirst + node.mLength << ")";
+        if (node.mIsMerge) {
+            out << "\\nstack " << node.mStackPos << "/" << node.mStackSize
+                << "\\ngallop " << node.GetGallopFraction() << "\\n" << node.mNumBytesMoved << " B\", shape=ellipse];\n";
+            out << "  n" << id << " -> n" << node.mLeft << ";\n";
+            out << "  n" << id << " -> n" << node.mRight << ";\n";
+        } else {
+            out << "\\nnatural " << node.mNaturalLength << (node.mIsDescending ? " desc" : "") << "\"";
+            out << (node.mLength > node.mNaturalLength ? ", style=filled" : "") << "];\n";
+        }
+    }
+
+    out << "}\n";
+}
+
+#endif
@@ -19,7 +19,14 @@
 #include <iostream>
 #include <algorithm>
 #include <sstream>
+#include <cstdlib>
+#include <unistd.h>
 #include "timsort.h"
+#include "timsort_external.h"
+#include "timsort_streaming.h"
+#include "timsort_join.h"
+#include "timsort_reorder.h"
+#include "timsort_tree.h"
 
 using namespace std;
 
@@ -47,6 +54,11 @@ struct TestState
     TestState() : mIsFail(false) {}
 };
 
+// Order (key, input position) pairs by the key only, so the position tells which duplicate was kept.
+struct KeyLess
+{
+    bool operator()(const pair<int, size_t> &a, const pair<int, size_t> &b) const { return a.first < b.first; }
+};
 
 struct TimSortUT
 {
@@ -56,9 +68,32 @@ struct TimSortUT
     static TestState TestMerge(bool isTestMergeLow);
     static TestState TestTryMerge();
     static TestState TestTimSort();
+    static TestState TestTimSortAppend();
+    static TestState TestTimSortExternal();
+    static TestState TestStreamingTimSort();
+    static TestState TestTimPartialSort();
+    static TestState TestTimMergeK();
+    static TestState TestTimMerge();
+    static TestState TestMinGallop();
+    static TestState TestTimSetOperations();
+    static TestState TestTimFingerSearch();
+    static TestState TestTimMergeJoin();
+    static TestState TestTimSortUnique();
+    static TestState TestTimSortReduce();
+    static TestState TestTimSortCountInversions();
+    static TestState TestTimSortFewDistinct();
+    static TestState TestTimSortBounded();
+    static TestState TestTimSortReorderBuffer();
+    static TestState TestTimSortStats();
+    static TestState TestTimSortHooks();
+    static TestState TestTimSortPhaseTimes();
+    static TestState TestTimSortMergeTree();
     
     // Helper function
     static size_t CalcMinRunLength(size_t aSize);
+    static string CreateTmpFile(const string &dir);
+    static void MakeMixedRuns(size_t numElems, size_t descendingLength, vector<int> &v, vector<int> &gold);
+    static void MakeLateManyDistinct(size_t numElems, vector<int> &v, vector<int> &gold);
 };
 
 TestState TimSortUT::TestInsertionSort()
@@ -108,6 +143,46 @@ size_t TimSortUT::CalcMinRunLength(size_t aSize)
     return sMinRun + sBumper;
 }
 
+// Create an empty file with a unique name in dir, as the external sort creates its spill files.
+string TimSortUT::CreateTmpFile(const string &dir)
+{
+    string path = dir + "/timsort_ut_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    assert(fd >= 0);
+    close(fd);
+    return path;
+}
+
+// Random stretches of 10 elements and descending ones of descendingLength, so that there are natural and boosted runs
+// and galloping merges. gold is v sorted.
+void TimSortUT::MakeMixedRuns(size_t numElems, size_t descendingLength, vector<int> &v, vector<int> &gold)
+{
+    v.clear();
+    v.reserve(numElems);
+    while (v.size() < numElems) {
+        size_t length = rand() % 2 ? 10 : descendingLength;
+        int value = rand();
+        for (size_t i = 0; i < length && v.size() < numElems; ++i) {
+            v.push_back(length == 10 ? rand() : value--);
+        }
+    }
+    gold = v;
+    sort(gold.begin(), gold.end());
+}
+
+// Few distinct values in the first half and at the sampled positions, and distinct ascending values elsewhere, so that
+// the grouping path passes the sample and gives up halfway. gold is v sorted.
+void TimSortUT::MakeLateManyDistinct(size_t numElems, vector<int> &v, vector<int> &gold)
+{
+    size_t step = numElems / TimSortImpl::kFewDistinctSampleSize;
+    v.resize(numElems);
+    for (size_t i = 0; i < numElems; ++i) {
+        v[i] = i < numElems / 2 || i % step == 0 ? rand() % 10 : static_cast<int>(1000 + i);
+    }
+    gold = v;
+    sort(gold.begin(), gold.end());
+}
+
 TestState TimSortUT::TestCalcMinRunLength()
 {
     TestState state;
@@ -323,6 +398,19 @@ TestState TimSortUT::TestTryMerge()
     }
     TimSortImpl::TryMerge(mergeState, less<int>());
 
+    // The stack invariants must hold after TryMerge: A > B + C and B > C.
+    for (size_t pos = 0; pos + 1 < mergeState.mNumRunInStack; ++pos) {
+        size_t lengthA = mergeState.mStack[pos].GetLength();
+        size_t lengthB = mergeState.mStack[pos + 1].GetLength();
+        size_t lengthC = pos + 2 < mergeState.mNumRunInStack ? mergeState.mStack[pos + 2].GetLength() : 0;
+        if (lengthA <= lengthB + lengthC) {
+            state.mIsFail = true;
+            state.mMsg = testName + "\t FAIL! Stack invariants are broken.";
+            return state;
+        }
+    }
+    TimSortImpl::ForceMerge(mergeState, less<int>());
+
     vector<int>::iterator i = v.begin();
     vector<int>::iterator j = i + 1;
     while (j != v.end()) {
@@ -369,38 +457,1336 @@ TestState TimSortUT::TestTimSort()
     return state;
 }
 
-void PrintFailureMsg(const TestState &state)
+TestState TimSortUT::TestTimSortAppend()
 {
-    if (state.mMsg.empty() == false) {
-        cerr << state.mMsg << endl;
+    const size_t kNumElems = 1000000;
+    const size_t kNumBatches = 100;
+    TestState state;
+    state.mMsg = "TestTimSortAppend\t PASS!";
+
+    vector<int> v;
+    vector<int> gold;
+    v.reserve(kNumElems);
+    for (size_t batch = 0; batch < kNumBatches; ++batch) {
+        size_t sortedSize = v.size();
+        size_t batchSize = rand() % (2 * kNumElems / kNumBatches);
+        for (size_t i = 0; i < batchSize; ++i) {
+            v.push_back(rand() % kNumElems);
+        }
+
+        gold = v;
+        sort(gold.begin(), gold.end());
+        TimSortAppend(v.begin(), v.begin() + sortedSize, v.end());
+
+        if (v != gold) {
+            state.mIsFail = true;
+            state.mMsg =
+                "TestTimSortAppend FAIL! batch: " + ToString(batch) + ", sorted prefix: " + ToString(sortedSize) +
+                ", batch size: " + ToString(batchSize);
+            break;
+        }
     }
+
+    return state;
 }
 
-int main()
+TestState TimSortUT::TestTimSortExternal()
 {
-    srand(time(NULL));
+    const size_t kNumElems = 1000000;
+    // Small enough to produce many runs and more than one merge pass.
+    const size_t kMemoryBudget = 256 * 1024;
+    const string kTmpDir = "/tmp";
+    const string inputPath = CreateTmpFile(kTmpDir);
+    const string outputPath = CreateTmpFile(kTmpDir);
     TestState state;
+    state.mMsg = "TestTimSortExternal\t PASS!";
 
-    //state = TimSortUT::TestInsertionSort();
-    PrintFailureMsg(state);
+    vector<int> v;
+    v.reserve(kNumElems);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        v.push_back(rand());
+    }
+    FILE *file = fopen(inputPath.c_str(), "wb");
+    fwrite(&v[0], sizeof(int), v.size(), file);
+    fclose(file);
+
+    TimSortExternal<int> sorter(kMemoryBudget, kTmpDir);
+    bool isOk = sorter.Sort(inputPath, outputPath);
+    TimSortExternalStats stats = sorter.GetStats();
+
+    vector<int> result(kNumElems + 1);
+    file = fopen(outputPath.c_str(), "rb");
+    size_t numRead = file != NULL ? fread(&result[0], sizeof(int), result.size(), file) : 0;
+    if (file != NULL) {
+        fclose(file);
+    }
+    result.resize(numRead);
 
-    //state = TimSortUT::TestCalcMinRunLength();
-    PrintFailureMsg(state);
+    // A trailing partial record is an error, not dropped.
+    file = fopen(inputPath.c_str(), "ab");
+    fwrite(&v[0], 1, sizeof(int) - 1, file);
+    fclose(file);
+    bool isPartialOk = sorter.Sort(inputPath, outputPath);
 
-    //state = TimSortUT::TestGallop();
-    PrintFailureMsg(state);
+    remove(inputPath.c_str());
+    remove(outputPath.c_str());
 
-    //state = TimSortUT::TestMerge(true);
-    PrintFailureMsg(state);
+    sort(v.begin(), v.end());
+    if (isOk == false || result != v) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortExternal FAIL! output size: " + ToString(numRead);
+    } else if (isPartialOk) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortExternal FAIL! a partial record was accepted.";
+    } else if (stats.mNumRuns < 2 || stats.mNumPasses < 2 || stats.mMergeFanIn < 2 ||
+               stats.mSpillBytes < kNumElems * sizeof(int)) {
+        state.mIsFail = true;
+        state.mMsg =
+            "TestTimSortExternal FAIL! runs: " + ToString(stats.mNumRuns) + ", passes: " + ToString(stats.mNumPasses) +
+            ", fan-in: " + ToString(stats.mMergeFanIn) + ", spill bytes: " + ToString(stats.mSpillBytes);
+    }
 
-    //state = TimSortUT::TestMerge(false);
-    PrintFailureMsg(state);
+    return state;
+}
 
-    //state = TimSortUT::TestTryMerge();
-    PrintFailureMsg(state);
+static size_t gNumAssigns = 0;
 
-    state = TimSortUT::TestTimSort();
+// An int that counts its assignments, the moves of a sort.
+struct AssignCountedInt
+{
+    int mValue;
+
+    AssignCountedInt(int value = 0) : mValue(value) {}
+
+    AssignCountedInt(const AssignCountedInt &other) : mValue(other.mValue) { ++gNumAssigns; }
+
+    AssignCountedInt &operator=(const AssignCountedInt &other)
+    {
+        ++gNumAssigns;
+        mValue = other.mValue;
+        return *this;
+    }
+
+    bool operator<(const AssignCountedInt &other) const { return mValue < other.mValue; }
+};
+
+TestState TimSortUT::TestStreamingTimSort()
+{
+    const size_t kNumElems = 1000000;
+    TestState state;
+    state.mMsg = "TestStreamingTimSort\t PASS!";
+
+    // Mix random stretches with ascending and descending ones to exercise both natural and boosted runs.
+    vector<int> v;
+    v.reserve(kNumElems);
+    while (v.size() < kNumElems) {
+        size_t length = rand() % 1000;
+        int value = rand();
+        int shape = rand() % 3;
+        for (size_t i = 0; i < length && v.size() < kNumElems; ++i) {
+            v.push_back(shape == 0 ? rand() : (shape == 1 ? value++ : value--));
+        }
+    }
+
+    StreamingTimSort<int> sorter;
+    sorter.PushRange(v.begin(), v.begin() + kNumElems / 2);
+    for (size_t i = kNumElems / 2; i < kNumElems; ++i) {
+        sorter.Push(v[i]);
+    }
+
+    vector<int> result;
+    sorter.Finish(back_inserter(result));
+
+    sort(v.begin(), v.end());
+    if (result != v) {
+        state.mIsFail = true;
+        state.mMsg = "TestStreamingTimSort FAIL! Finish(out) is not sorted.";
+        return state;
+    }
+
+    int value;
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (sorter.Next(value) == false || value != v[i]) {
+            state.mIsFail = true;
+            state.mMsg = "TestStreamingTimSort FAIL! Next() at " + ToString(i);
+            return state;
+        }
+    }
+    if (sorter.Next(value)) {
+        state.mIsFail = true;
+        state.mMsg = "TestStreamingTimSort FAIL! Next() returns more elements than pushed.";
+        return state;
+    }
+
+    // Push more after Finish(). The next Finish() merges them in, and Next() starts over.
+    for (int i = 0; i < 1000; ++i) {
+        v.push_back(rand());
+        sorter.Push(v.back());
+    }
+    sorter.Finish();
+    sort(v.begin(), v.end());
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (sorter.Next(value) == false || value != v[i]) {
+            state.mIsFail = true;
+            state.mMsg = "TestStreamingTimSort FAIL! Next() after another Finish() at " + ToString(i);
+            return state;
+        }
+    }
+
+    // A long sorted backlog spread over all ticks, then ticks that push a shuffled batch and pop everything below it.
+    // The backlog left after each pop must not be moved again, so the moves stay proportional to the pushes.
+    const size_t kNumBacklog = 100000;
+    const size_t kNumTicks = 1000;
+    const int kBatch = 100;
+    StreamingTimSort<AssignCountedInt> ticker;
+    vector<int> pushed;
+    vector<AssignCountedInt> popped;
+    popped.reserve(kNumBacklog + kNumTicks * kBatch);
+    for (size_t i = 0; i < kNumBacklog; ++i) {
+        pushed.push_back(static_cast<int>(i * kNumTicks * kBatch / kNumBacklog));
+        ticker.Push(pushed.back());
+    }
+    gNumAssigns = 0;
+    for (size_t t = 0; t < kNumTicks; ++t) {
+        int batchFirst = static_cast<int>(t) * kBatch;
+        for (int i = 0; i < kBatch; ++i) {
+            pushed.push_back(batchFirst + rand() % (3 * kBatch));
+            ticker.Push(pushed.back());
+        }
+        ticker.PopUpTo(batchFirst - 1, back_inserter(popped));
+    }
+    size_t numAssigns = gNumAssigns;
+    ticker.Finish(back_inserter(popped));
+
+    sort(pushed.begin(), pushed.end());
+    bool isSorted = popped.size() == pushed.size();
+    for (size_t i = 0; isSorted && i < pushed.size(); ++i) {
+        isSorted = popped[i].mValue == pushed[i];
+    }
+    if (isSorted == false || numAssigns > 50 * kNumTicks * kBatch) {
+        state.mIsFail = true;
+        state.mMsg = "TestStreamingTimSort FAIL! PopUpTo() ticks, moves: " + ToString(numAssigns);
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimPartialSort()
+{
+    const size_t kNumElems = 1000000;
+    const size_t kNumTop = 1000;
+    TestState state;
+    state.mMsg = "TestTimPartialSort\t PASS!";
+
+    // A mostly sorted input with some random elements.
+    vector<int> v;
+    v.reserve(kNumElems);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        v.push_back(rand() % 100 == 0 ? rand() % kNumElems : i);
+    }
+    vector<int> gold = v;
+    sort(gold.begin(), gold.end());
+
+    vector<int> top;
+    TimTopK(v.begin(), v.end(), kNumTop, back_inserter(top));
+    if (top.size() != kNumTop || equal(top.begin(), top.end(), gold.begin()) == false) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimPartialSort FAIL! TimTopK returns wrong elements.";
+        return state;
+    }
+
+    TimPartialSort(v.begin(), v.begin() + kNumTop, v.end());
+    if (equal(v.begin(), v.begin() + kNumTop, gold.begin()) == false) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimPartialSort FAIL! The head is not the smallest elements in order.";
+        return state;
+    }
+
+    // The rest elements must be kept, in any order.
+    sort(v.begin() + kNumTop, v.end());
+    if (v != gold) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimPartialSort FAIL! The tail elements are lost.";
+        return state;
+    }
+
+    // A large k on random and descending inputs, where most elements enter the buffer at some point.
+    // The keys repeat and the input positions are kept, so that the stability is checked too.
+    const size_t kNumLargeTop = kNumElems / 10;
+    for (int isDescending = 0; isDescending < 2; ++isDescending) {
+        vector<pair<int, size_t> > w;
+        w.reserve(kNumElems);
+        for (size_t i = 0; i < kNumElems; ++i) {
+            int key = isDescending ? static_cast<int>((kNumElems - i) / 4) : rand() % (kNumElems / 4);
+            w.push_back(make_pair(key, i));
+        }
+        vector<pair<int, size_t> > stableGold = w;
+        stable_sort(stableGold.begin(), stableGold.end(), KeyLess());
+
+        vector<pair<int, size_t> > largeTop;
+        TimTopK(w.begin(), w.end(), kNumLargeTop, back_inserter(largeTop), KeyLess());
+        TimPartialSort(w.begin(), w.begin() + kNumLargeTop, w.end(), KeyLess());
+        if (largeTop.size() != kNumLargeTop || equal(largeTop.begin(), largeTop.end(), stableGold.begin()) == false ||
+            equal(w.begin(), w.begin() + kNumLargeTop, stableGold.begin()) == false) {
+            state.mIsFail = true;
+            state.mMsg = "TestTimPartialSort FAIL! A large k on " + string(isDescending ? "descending" : "random") +
+                         " input.";
+            break;
+        }
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimMergeK()
+{
+    const size_t kNumElems = 1000000;
+    const size_t kNumRanges = 100;
+    TestState state;
+    state.mMsg = "TestTimMergeK\t PASS!";
+
+    vector<int> v;
+    v.reserve(kNumElems);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        v.push_back(rand() % kNumElems);
+    }
+
+    // Cut the input in ranges of random lengths, some of them empty, and sort each one.
+    vector<size_t> cuts;
+    cuts.push_back(0);
+    cuts.push_back(kNumElems);
+    for (size_t i = 0; i < kNumRanges - 1; ++i) {
+        cuts.push_back(rand() % kNumElems);
+    }
+    cuts.push_back(cuts.back());
+    sort(cuts.begin(), cuts.end());
+
+    vector<pair<vector<int>::iterator, vector<int>::iterator> > ranges;
+    for (size_t i = 0; i + 1 < cuts.size(); ++i) {
+        sort(v.begin() + cuts[i], v.begin() + cuts[i + 1]);
+        ranges.push_back(make_pair(v.begin() + cuts[i], v.begin() + cuts[i + 1]));
+    }
+
+    vector<int> result(kNumElems);
+    vector<int>::iterator end = TimMergeK(ranges, result.begin());
+
+    sort(v.begin(), v.end());
+    if (end != result.end() || result != v) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimMergeK FAIL!";
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimMerge()
+{
+    const size_t kNumElems = 1000000;
+    TestState state;
+    state.mMsg = "TestTimMerge\t PASS!";
+
+    // Run A is short and run B is long, with duplicates across both.
+    vector<int> v;
+    v.reserve(kNumElems);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        v.push_back(rand() % (kNumElems / 10));
+    }
+    size_t pivot = rand() % (kNumElems / 10);
+    sort(v.begin(), v.begin() + pivot);
+    sort(v.begin() + pivot, v.end());
+
+    vector<int> gold = v;
+    inplace_merge(gold.begin(), gold.begin() + pivot, gold.end());
+
+    vector<int> result(kNumElems);
+    vector<int>::iterator end = TimMerge(v.begin(), v.begin() + pivot, v.begin() + pivot, v.end(), result.begin());
+    if (end != result.end() || result != gold) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimMerge FAIL! Out of place merge, pivot: " + ToString(pivot);
+        return state;
+    }
+
+    TimMerge(v.begin(), v.begin() + pivot, v.end());
+    if (v != gold) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimMerge FAIL! In place merge, pivot: " + ToString(pivot);
+    }
+
+    return state;
+}
+
+static size_t gNumCompares = 0;
+
+struct CountingLess
+{
+    bool operator()(int a, int b) const
+    {
+        ++gNumCompares;
+        return a < b;
+    }
+};
+
+TestState TimSortUT::TestMinGallop()
+{
+    const size_t kNumElems = 200000;
+    TestState state;
+    state.mMsg = "TestMinGallop\t PASS!";
+
+    // On interleaved random runs galloping never pays off, so the merges must stay in the one-pair-at-a-time mode.
+    // If minGallop sank on each gallop round, they would gallop on most elements at about 1.6 comparisons each.
+    vector<int> v(kNumElems);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        v[i] = rand();
+    }
+    sort(v.begin(), v.begin() + kNumElems / 2);
+    sort(v.begin() + kNumElems / 2, v.end());
+    vector<int> gold(v);
+    sort(gold.begin(), gold.end());
+
+    vector<int> merged;
+    gNumCompares = 0;
+    TimMerge(v.begin(), v.begin() + kNumElems / 2, v.begin() + kNumElems / 2, v.end(), back_inserter(merged),
+             CountingLess());
+    if (merged != gold || gNumCompares > kNumElems * 21 / 20) {
+        state.mIsFail = true;
+        state.mMsg = "TestMinGallop FAIL! Out of place merge, comparisons: " + ToString(gNumCompares);
+        return state;
+    }
+
+    gNumCompares = 0;
+    TimMerge(v.begin(), v.begin() + kNumElems / 2, v.end(), CountingLess());
+    if (v != gold || gNumCompares > kNumElems * 21 / 20) {
+        state.mIsFail = true;
+        state.mMsg = "TestMinGallop FAIL! In place merge, comparisons: " + ToString(gNumCompares);
+        return state;
+    }
+
+    // A loser tree of 2 ranges replays one comparison per element.
+    for (size_t i = 0; i < kNumElems; ++i) {
+        v[i] = rand();
+    }
+    sort(v.begin(), v.begin() + kNumElems / 2);
+    sort(v.begin() + kNumElems / 2, v.end());
+    vector<pair<vector<int>::iterator, vector<int>::iterator> > ranges;
+    ranges.push_back(make_pair(v.begin(), v.begin() + kNumElems / 2));
+    ranges.push_back(make_pair(v.begin() + kNumElems / 2, v.end()));
+    gold = v;
+    sort(gold.begin(), gold.end());
+    merged.clear();
+    gNumCompares = 0;
+    TimMergeK(ranges, back_inserter(merged), CountingLess());
+    if (merged != gold || gNumCompares > kNumElems * 21 / 20) {
+        state.mIsFail = true;
+        state.mMsg = "TestMinGallop FAIL! K-way merge, comparisons: " + ToString(gNumCompares);
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSetOperations()
+{
+    const size_t kNumLarge = 10000000;
+    const size_t kNumSmall = 100;
+    TestState state;
+    state.mMsg = "TestTimSetOperations\t PASS!";
+
+    vector<int> large;
+    large.reserve(kNumLarge);
+    for (size_t i = 0; i < kNumLarge; ++i) {
+        large.push_back(rand() % (kNumLarge / 2));
+    }
+    sort(large.begin(), large.end());
+    vector<int> small;
+    for (size_t i = 0; i < kNumSmall; ++i) {
+        small.push_back(rand() % (kNumLarge / 2));
+    }
+    sort(small.begin(), small.end());
+
+    vector<int> result;
+    vector<int> gold;
+    gNumCompares = 0;
+    TimSetIntersection(small.begin(), small.end(), large.begin(), large.end(), back_inserter(result), CountingLess());
+    set_intersection(small.begin(), small.end(), large.begin(), large.end(), back_inserter(gold));
+    // Galloping over the gaps costs about 2 * log2(gap) comparisons per small element, far less than kNumLarge.
+    if (result != gold || gNumCompares > 100 * kNumSmall) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSetOperations FAIL! Intersection, compares: " + ToString(gNumCompares);
+        return state;
+    }
+
+    result.clear();
+    gold.clear();
+    TimSetDifference(small.begin(), small.end(), large.begin(), large.end(), back_inserter(result));
+    set_difference(small.begin(), small.end(), large.begin(), large.end(), back_inserter(gold));
+    if (result != gold) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSetOperations FAIL! Difference.";
+        return state;
+    }
+
+    result.clear();
+    gold.clear();
+    TimSetUnion(small.begin(), small.end(), large.begin(), large.end(), back_inserter(result));
+    set_union(small.begin(), small.end(), large.begin(), large.end(), back_inserter(gold));
+    if (result != gold) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSetOperations FAIL! Union.";
+        return state;
+    }
+
+    // The k-way intersection must be the same as intersecting the ranges one by one.
+    vector<int> medium(large.begin(), large.begin() + kNumLarge / 100);
+    vector<pair<vector<int>::iterator, vector<int>::iterator> > ranges;
+    ranges.push_back(make_pair(large.begin(), large.end()));
+    ranges.push_back(make_pair(medium.begin(), medium.end()));
+    ranges.push_back(make_pair(small.begin(), small.end()));
+
+    result.clear();
+    gold.clear();
+    vector<int> tmp;
+    TimSetIntersectionK(ranges, back_inserter(result));
+    set_intersection(large.begin(), large.end(), medium.begin(), medium.end(), back_inserter(tmp));
+    set_intersection(tmp.begin(), tmp.end(), small.begin(), small.end(), back_inserter(gold));
+    if (result != gold) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSetOperations FAIL! K-way intersection.";
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimFingerSearch()
+{
+    const size_t kNumElems = 1000000;
+    const size_t kNumNeedles = 10000;
+    TestState state;
+    state.mMsg = "TestTimFingerSearch\t PASS!";
+
+    vector<int> haystack;
+    haystack.reserve(kNumElems);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        haystack.push_back(rand() % kNumElems);
+    }
+    sort(haystack.begin(), haystack.end());
+
+    // Sorted needles with some out of order ones, including values beyond both ends of the haystack.
+    vector<int> needles;
+    for (size_t i = 0; i < kNumNeedles; ++i) {
+        needles.push_back(static_cast<int>(rand() % (kNumElems + 20)) - 10);
+    }
+    sort(needles.begin(), needles.end());
+    for (size_t i = 0; i < kNumNeedles / 100; ++i) {
+        swap(needles[rand() % kNumNeedles], needles[rand() % kNumNeedles]);
+    }
+
+    vector<vector<int>::iterator> lowers;
+    vector<vector<int>::iterator> uppers;
+    gNumCompares = 0;
+    TimLowerBounds(haystack.begin(), haystack.end(), needles.begin(), needles.end(), back_inserter(lowers), CountingLess());
+    size_t numCompares = gNumCompares;
+    TimUpperBounds(haystack.begin(), haystack.end(), needles.begin(), needles.end(), back_inserter(uppers));
+
+    for (size_t i = 0; i < kNumNeedles; ++i) {
+        if (lowers[i] != lower_bound(haystack.begin(), haystack.end(), needles[i]) ||
+            uppers[i] != upper_bound(haystack.begin(), haystack.end(), needles[i])) {
+            state.mIsFail = true;
+            state.mMsg = "TestTimFingerSearch FAIL! needle: " + ToString(needles[i]);
+            return state;
+        }
+    }
+
+    // The gaps are about kNumElems / kNumNeedles = 100 elements, so a search costs about 2 * log2(100) comparisons,
+    // less than the log2(kNumElems) = 20 of a plain binary search.
+    if (numCompares > 20 * kNumNeedles) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimFingerSearch FAIL! Too many compares: " + ToString(numCompares);
+    }
+
+    return state;
+}
+
+// Rows of the join test. The tables have different row types that share the key.
+struct JoinLeftRow
+{
+    int mKey;
+    size_t mId;
+};
+
+struct JoinRightRow
+{
+    int mKey;
+    double mValue;
+};
+
+struct JoinKeyLess
+{
+    bool operator()(const JoinLeftRow &a, const JoinLeftRow &b) const { return a.mKey < b.mKey; }
+    bool operator()(const JoinRightRow &a, const JoinRightRow &b) const { return a.mKey < b.mKey; }
+    bool operator()(const JoinLeftRow &a, const JoinRightRow &b) const { return a.mKey < b.mKey; }
+    bool operator()(const JoinRightRow &a, const JoinLeftRow &b) const { return a.mKey < b.mKey; }
+};
+
+TestState TimSortUT::TestTimMergeJoin()
+{
+    const size_t kNumLeftRows = 20000;
+    const size_t kNumRightRows = 5000;
+    const int kNumKeys = 10000;
+    TestState state;
+    state.mMsg = "TestTimMergeJoin\t PASS!";
+
+    vector<JoinLeftRow> left(kNumLeftRows);
+    for (size_t i = 0; i < kNumLeftRows; ++i) {
+        left[i].mKey = rand() % kNumKeys;
+        left[i].mId = i;
+    }
+    vector<JoinRightRow> right(kNumRightRows);
+    for (size_t i = 0; i < kNumRightRows; ++i) {
+        right[i].mKey = rand() % kNumKeys;
+        right[i].mValue = static_cast<double>(i);
+    }
+
+    TimJoinType joinTypes[] = { kTimInnerJoin, kTimLeftOuterJoin, kTimSemiJoin };
+    for (size_t t = 0; t < sizeof(joinTypes) / sizeof(joinTypes[0]); ++t) {
+        vector<JoinLeftRow> l = left;
+        vector<JoinRightRow> r = right;
+        vector<pair<size_t, size_t> > pairs;
+        TimMergeJoin(l.begin(), l.end(), r.begin(), r.end(), joinTypes[t], JoinKeyLess(), pairs);
+
+        // The gold result: the stable sort of both tables, then the matches of each left row by binary search.
+        vector<JoinLeftRow> sortedLeft = left;
+        vector<JoinRightRow> sortedRight = right;
+        stable_sort(sortedLeft.begin(), sortedLeft.end(), JoinKeyLess());
+        stable_sort(sortedRight.begin(), sortedRight.end(), JoinKeyLess());
+        vector<pair<size_t, size_t> > gold;
+        for (size_t i = 0; i < sortedLeft.size(); ++i) {
+            pair<vector<JoinRightRow>::iterator, vector<JoinRightRow>::iterator> matches =
+                equal_range(sortedRight.begin(), sortedRight.end(), sortedLeft[i], JoinKeyLess());
+            if (matches.first == matches.second) {
+                if (joinTypes[t] == kTimLeftOuterJoin) {
+                    gold.push_back(make_pair(i, kTimJoinNoMatch));
+                }
+                continue;
+            }
+            if (joinTypes[t] == kTimSemiJoin) {
+                matches.second = matches.first + 1;
+            }
+            for (vector<JoinRightRow>::iterator j = matches.first; j < matches.second; ++j) {
+                gold.push_back(make_pair(i, static_cast<size_t>(j - sortedRight.begin())));
+            }
+        }
+
+        bool isSame = pairs == gold;
+        for (size_t i = 0; isSame && i < l.size(); ++i) {
+            isSame = l[i].mId == sortedLeft[i].mId;
+        }
+        for (size_t i = 0; isSame && i < r.size(); ++i) {
+            isSame = r[i].mValue == sortedRight[i].mValue;
+        }
+        if (isSame == false) {
+            state.mIsFail = true;
+            state.mMsg = "TestTimMergeJoin FAIL! join type: " + ToString(joinTypes[t]);
+            return state;
+        }
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortUnique()
+{
+    const size_t kNumElems = 1000000;
+    const int kNumKeysList[] = { 1, 10, 1000, 1000000 };
+    TestState state;
+    state.mMsg = "TestTimSortUnique\t PASS!";
+
+    for (size_t c = 0; c < sizeof(kNumKeysList) / sizeof(kNumKeysList[0]); ++c) {
+        vector<pair<int, size_t> > input;
+        input.reserve(kNumElems);
+        for (size_t i = 0; i < kNumElems; ++i) {
+            input.push_back(make_pair(rand() % kNumKeysList[c], i));
+        }
+
+        vector<pair<int, size_t> > sorted = input;
+        stable_sort(sorted.begin(), sorted.end(), KeyLess());
+
+        TimUniquePolicy policies[] = { kTimKeepFirst, kTimKeepLast };
+        for (size_t p = 0; p < 2; ++p) {
+            // The gold result keeps the first or the last element of each group of equal keys of the stable sort.
+            vector<pair<int, size_t> > gold;
+            for (size_t i = 0; i < sorted.size(); ++i) {
+                if (i > 0 && sorted[i].first == sorted[i - 1].first) {
+                    if (policies[p] == kTimKeepLast) {
+                        gold.back() = sorted[i];
+                    }
+                    continue;
+                }
+                gold.push_back(sorted[i]);
+            }
+
+            vector<pair<int, size_t> > v = input;
+            v.erase(TimSortUnique(v.begin(), v.end(), KeyLess(), policies[p]), v.end());
+            if (v != gold) {
+                state.mIsFail = true;
+                state.mMsg =
+                    "TestTimSortUnique FAIL! num keys: " + ToString(kNumKeysList[c]) + ", policy: " + ToString(policies[p]);
+                return state;
+            }
+        }
+    }
+
+    return state;
+}
+
+// Aggregate the events of one key: the count, the sum and the concatenation of the values.
+// The concatenation is associative but not commutative, so it tells whether the groups are folded in input order.
+struct KeyStats
+{
+    int mKey;
+    size_t mCount;
+    long long mSum;
+    string mValues;
+
+    KeyStats() : mKey(0), mCount(0), mSum(0) {}
+};
+
+struct KeyStatsLess
+{
+    bool operator()(const KeyStats &a, const KeyStats &b) const { return a.mKey < b.mKey; }
+};
+
+struct KeyStatsReduce
+{
+    void operator()(KeyStats &kept, const KeyStats &next) const
+    {
+        kept.mCount += next.mCount;
+        kept.mSum += next.mSum;
+        kept.mValues += next.mValues;
+    }
+};
+
+TestState TimSortUT::TestTimSortReduce()
+{
+    const size_t kNumElems = 200000;
+    const int kNumKeys = 500;
+    TestState state;
+    state.mMsg = "TestTimSortReduce\t PASS!";
+
+    vector<KeyStats> v(kNumElems);
+    vector<KeyStats> gold(kNumKeys);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        int value = rand() % 10;
+        v[i].mKey = rand() % kNumKeys;
+        v[i].mCount = 1;
+        v[i].mSum = value;
+        v[i].mValues = ToString(value);
+
+        KeyStats &g = gold[v[i].mKey];
+        g.mKey = v[i].mKey;
+        g.mCount += 1;
+        g.mSum += value;
+        g.mValues += v[i].mValues;
+    }
+
+    vector<KeyStats>::iterator last = TimSortReduce(v.begin(), v.end(), KeyStatsLess(), KeyStatsReduce());
+
+    // Every key occurs with kNumElems / kNumKeys = 400 elements on average, so all of them are present.
+    bool isSame = static_cast<size_t>(last - v.begin()) == gold.size();
+    for (size_t i = 0; isSame && i < gold.size(); ++i) {
+        isSame = v[i].mKey == gold[i].mKey && v[i].mCount == gold[i].mCount &&
+                 v[i].mSum == gold[i].mSum && v[i].mValues == gold[i].mValues;
+    }
+    if (isSame == false) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortReduce FAIL!";
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortCountInversions()
+{
+    const size_t kNumElems = 3000;
+    TestState state;
+    state.mMsg = "TestTimSortCountInversions\t PASS!";
+
+    // Random values with duplicates, descending runs, and ascending runs with a few displaced elements.
+    for (size_t shape = 0; shape < 3; ++shape) {
+        vector<int> v(kNumElems);
+        for (size_t i = 0; i < kNumElems; ++i) {
+            if (shape == 0) {
+                v[i] = rand() % 100;
+            } else if (shape == 1) {
+                v[i] = (i / 500) * 500 - static_cast<int>(i % 500) / 2;
+            } else {
+                v[i] = rand() % 50 == 0 ? rand() % kNumElems : i;
+            }
+        }
+
+        // The gold count by brute force.
+        uint64_t gold = 0;
+        for (size_t i = 0; i < kNumElems; ++i) {
+            for (size_t j = i + 1; j < kNumElems; ++j) {
+                gold += v[j] < v[i];
+            }
+        }
+
+        vector<int> sorted = v;
+        sort(sorted.begin(), sorted.end());
+        uint64_t result = TimSortCountInversions(v.begin(), v.end());
+        if (result != gold || v != sorted) {
+            state.mIsFail = true;
+            state.mMsg =
+                "TestTimSortCountInversions FAIL! shape: " + ToString(shape) +
+                ", gold: " + ToString(gold) + ", result: " + ToString(result);
+            return state;
+        }
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortFewDistinct()
+{
+    // Odd, so that the halves of the grouping scatter differ in length.
+    const size_t kNumElems = 100001;
+    // Within the low cardinality limit, at it, and beyond it by one rare value.
+    const int kNumKeysList[] = { 3, 200, 256, 257 };
+    TestState state;
+    state.mMsg = "TestTimSortFewDistinct\t PASS!";
+
+    for (size_t c = 0; c < sizeof(kNumKeysList) / sizeof(kNumKeysList[0]); ++c) {
+        vector<pair<int, size_t> > v;
+        v.reserve(kNumElems);
+        for (size_t i = 0; i < kNumElems; ++i) {
+            v.push_back(make_pair((rand() % kNumKeysList[c]) * 1000 - 50000, i));
+        }
+        v[rand() % kNumElems].first = kNumKeysList[c] == 257 ? 1 << 30 : v[0].first;
+
+        // Pairs ordered by the key only take the stable grouping path, plain ints the counting path.
+        vector<int> keys;
+        for (size_t i = 0; i < kNumElems; ++i) {
+            keys.push_back(v[i].first);
+        }
+        vector<pair<int, size_t> > gold = v;
+        stable_sort(gold.begin(), gold.end(), KeyLess());
+        vector<int> goldKeys = keys;
+        sort(goldKeys.begin(), goldKeys.end());
+
+        TimSort(v.begin(), v.end(), KeyLess());
+        TimSort(keys.begin(), keys.end());
+        if (v != gold || keys != goldKeys) {
+            state.mIsFail = true;
+            state.mMsg = "TestTimSortFewDistinct FAIL! num keys: " + ToString(kNumKeysList[c]);
+            return state;
+        }
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortBounded()
+{
+    const size_t kNumElems = 100000;
+    // Both the linear insertion and the chunked merge are used.
+    const size_t kBounds[] = { 0, 1, 16, 128, 129, 5000 };
+    TestState state;
+    state.mMsg = "TestTimSortBounded\t PASS!";
+
+    for (size_t b = 0; b < sizeof(kBounds) / sizeof(kBounds[0]); ++b) {
+        size_t k = kBounds[b];
+        for (size_t isViolated = 0; isViolated < 2; ++isViolated) {
+            // Delaying every key by less than k + 1 keeps each element within k places of its sorted one,
+            // also among the equal keys made by the division. One far element breaks the bound.
+            vector<pair<int, size_t> > v;
+            v.reserve(kNumElems);
+            for (size_t i = 0; i < kNumElems; ++i) {
+                v.push_back(make_pair(static_cast<int>((i + rand() % (k + 1)) / 3), i));
+            }
+            if (isViolated) {
+                swap(v[kNumElems / 2], v[kNumElems / 2 + 3 * k + 4]);
+            }
+
+            vector<pair<int, size_t> > gold = v;
+            stable_sort(gold.begin(), gold.end(), KeyLess());
+            bool isBoundKept = TimSortBounded(v.begin(), v.end(), k, KeyLess());
+            if (v != gold || isBoundKept == static_cast<bool>(isViolated)) {
+                state.mIsFail = true;
+                state.mMsg =
+                    "TestTimSortBounded FAIL! k: " + ToString(k) + ", violated: " + ToString(isViolated) +
+                    ", bound kept: " + ToString(isBoundKept);
+                return state;
+            }
+        }
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortReorderBuffer()
+{
+    const size_t kNumEvents = 1000000;
+    const int kMaxDelay = 1000;
+    const size_t kTick = 5000;
+    TestState state;
+    state.mMsg = "TestTimSortReorderBuffer\t PASS!";
+
+    // Events are (time, id) pairs that arrive up to kMaxDelay late, and one in a thousand much later.
+    vector<pair<int, size_t> > events;
+    events.reserve(kNumEvents);
+    for (size_t i = 0; i < kNumEvents; ++i) {
+        int delay = rand() % 1000 == 0 ? 10 * kMaxDelay : rand() % kMaxDelay;
+        events.push_back(make_pair(static_cast<int>(i) - delay, i));
+    }
+
+    TimLatePolicy policies[] = { kTimDropLate, kTimAdmitLate };
+    for (size_t p = 0; p < 2; ++p) {
+        TimSortReorderBuffer<pair<int, size_t>, KeyLess> buffer(2 * kTick + kMaxDelay, policies[p]);
+        vector<pair<int, size_t> > accepted;
+        vector<pair<int, size_t> > emitted;
+        bool isEmitSorted = true;
+        for (size_t i = 0; i < kNumEvents; ++i) {
+            if (buffer.Push(events[i])) {
+                accepted.push_back(events[i]);
+            }
+            if ((i + 1) % kTick == 0) {
+                size_t numEmitted = emitted.size();
+                pair<int, size_t> watermark(static_cast<int>(i) - kMaxDelay, 0);
+                buffer.Emit(watermark, back_inserter(emitted));
+                for (size_t j = numEmitted + 1; j < emitted.size(); ++j) {
+                    isEmitSorted = isEmitSorted && emitted[j].first >= emitted[j - 1].first;
+                }
+            }
+        }
+        buffer.Flush(back_inserter(emitted));
+
+        // Without late events the emissions continue each other, so together they are the stable sort of the input.
+        // The late events admitted break that, each emission is sorted on its own then.
+        const TimSortReorderStats &stats = buffer.GetStats();
+        stable_sort(accepted.begin(), accepted.end(), KeyLess());
+        if (policies[p] == kTimAdmitLate) {
+            stable_sort(emitted.begin(), emitted.end(), KeyLess());
+        }
+        if (emitted != accepted || isEmitSorted == false ||
+            stats.mNumPushed != accepted.size() || stats.mNumEmitted != accepted.size() ||
+            stats.mNumLateDropped + stats.mNumLateAdmitted == 0 || stats.mNumRejected != 0 ||
+            stats.mNumPushed + stats.mNumLateDropped != kNumEvents || stats.mPeakSize > buffer.Capacity()) {
+            state.mIsFail = true;
+            state.mMsg = "TestTimSortReorderBuffer FAIL! policy: " + ToString(policies[p]);
+            return state;
+        }
+    }
+
+    // A full buffer refuses events until a watermark frees room.
+    TimSortReorderBuffer<int> small(10);
+    for (int i = 0; i < 20; ++i) {
+        small.Push(i);
+    }
+    vector<int> emitted;
+    small.Emit(4, back_inserter(emitted));
+    if (small.GetStats().mNumRejected != 10 || emitted.size() != 5 || small.Push(20) == false) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortReorderBuffer FAIL! The capacity is not kept.";
+    }
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortStats()
+{
+    const size_t kNumElems = 1000000;
+    TestState state;
+    state.mMsg = "TestTimSortStats\t PASS!";
+
+    vector<int> v;
+    vector<int> gold;
+    MakeMixedRuns(kNumElems, 10000, v, gold);
+
+    TimSortStats stats;
+    gNumCompares = 0;
+    TimSort(v.begin(), v.end(), CountingLess(), stats);
+
+    uint64_t numMergesBySize = 0;
+    for (size_t i = 0; i < TimSortStats::kNumSizeClasses; ++i) {
+        numMergesBySize += stats.mNumMergesBySize[i];
+    }
+
+    // Every run but the last one merged is merged once into another.
+    if (v != gold || stats.mNumCompares != gNumCompares || stats.mNumNaturalRuns == 0 || stats.mNumBoostedRuns == 0 ||
+        stats.mNumMerges != stats.mNumNaturalRuns + stats.mNumBoostedRuns - 1 || numMergesBySize != stats.mNumMerges ||
+        stats.mNumMergedElems < kNumElems || stats.mNumMoves < kNumElems || stats.mNumGallops == 0 ||
+        stats.mFinalMinGallop == 0 || stats.mNumAllocations == 0 ||
+        stats.mPeakMergeAreaBytes < kNumElems / 4 * sizeof(int) || stats.mPeakMergeAreaBytes > kNumElems / 2 * sizeof(int)) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortStats FAIL!";
+        return state;
+    }
+
+    // The grouping path that gives up late reports its grouped prefix as a run, and the merges that follow.
+    MakeLateManyDistinct(16384, v, gold);
+    stats = TimSortStats();
+    TimSort(v.begin(), v.end(), CountingLess(), stats);
+    if (v != gold || stats.mNumMerges == 0 || stats.mNumMerges != stats.mNumNaturalRuns + stats.mNumBoostedRuns - 1 ||
+        stats.mNumAllocations == 0 || stats.mFinalMinGallop == 0) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortStats FAIL! Late give up of the grouping path";
+    }
+
+    return state;
+}
+
+// Record the run and merge events of a sort, and check their order and the ranges they report.
+struct TraceHooks : public TimSortHooks
+{
+    typedef vector<int>::iterator Iterator;
+
+    Iterator mFirst;
+    Iterator mLast;
+    Iterator mNextRun;       // Where the next detected run must start
+    Iterator mMergeFirst;    // The range being merged, or mLast if none
+    Iterator mMergeLast;
+    size_t mNumPushed;
+    size_t mNumMerges;
+    size_t mNumGallops;
+    uint64_t mNumInversions;
+    bool mIsGalloping;
+    bool mIsValid;
+
+    TraceHooks(Iterator first, Iterator last)
+        : mFirst(first), mLast(last), mNextRun(first), mMergeFirst(last), mMergeLast(last),
+          mNumPushed(0), mNumMerges(0), mNumGallops(0), mNumInversions(0), mIsGalloping(false), mIsValid(true)
+    {
+    }
+
+    static bool IsSorted(Iterator first, Iterator last)
+    {
+        for (Iterator p = first; p < last && p + 1 < last; ++p) {
+            if (*(p + 1) < *p) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Check(bool condition) { mIsValid = mIsValid && condition; }
+
+    void OnRunDetected(Iterator first, Iterator last, bool)
+    {
+        Check(first == mNextRun && first < last && last <= mLast && IsSorted(first, last));
+    }
+
+    void OnRunBoosted(Iterator first, Iterator naturalLast, Iterator last)
+    {
+        Check(first == mNextRun && naturalLast < last && IsSorted(first, last));
+    }
+
+    void OnRunPushed(Iterator first, Iterator last, size_t stackSize)
+    {
+        Check(first == mNextRun && IsSorted(first, last) && stackSize > 0);
+        mNextRun = last;
+        ++mNumPushed;
+    }
+
+    void OnMergeBegin(size_t, Iterator firstA, Iterator firstB, Iterator lastB)
+    {
+        Check(mMergeFirst == mLast && firstA < firstB && firstB < lastB && lastB <= mNextRun &&
+              IsSorted(firstA, firstB) && IsSorted(firstB, lastB));
+        mMergeFirst = firstA;
+        mMergeLast = lastB;
+        ++mNumMerges;
+    }
+
+    void OnMergeEnd(Iterator first, Iterator last)
+    {
+        Check(first == mMergeFirst && last == mMergeLast && mIsGalloping == false && IsSorted(first, last));
+        mMergeFirst = mLast;
+    }
+
+    void OnGallopEnter()
+    {
+        Check(mIsGalloping == false && mMergeFirst != mLast);
+        mIsGalloping = true;
+        ++mNumGallops;
+    }
+
+    void OnGallopExit()
+    {
+        Check(mIsGalloping);
+        mIsGalloping = false;
+    }
+
+    void OnInversions(uint64_t numInversions) { mNumInversions += numInversions; }
+};
+
+TestState TimSortUT::TestTimSortHooks()
+{
+    const size_t kNumElems = 100000;
+    TestState state;
+    state.mMsg = "TestTimSortHooks\t PASS!";
+
+    vector<int> v;
+    vector<int> gold;
+    MakeMixedRuns(kNumElems, 1000, v, gold);
+    vector<int> counted = v;
+    uint64_t numInversions = TimSortCountInversions(counted.begin(), counted.end());
+
+    TraceHooks hooks(v.begin(), v.end());
+    TimSort(v.begin(), v.end(), less<int>(), hooks);
+
+    // The runs tile the range, and every run but one is merged into another.
+    // The hooks of a plain sort receive the same inversions as TimSortCountInversions counts.
+    if (v != gold || hooks.mIsValid == false || hooks.mNextRun != v.end() || hooks.mMergeFirst != v.end() ||
+        hooks.mNumMerges + 1 != hooks.mNumPushed || hooks.mNumGallops == 0 || hooks.mNumInversions != numInversions) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortHooks FAIL!";
+    }
+
+#ifdef TIMSORT_SDT_STUB
+    // Built by make probe_test: a plain sort fires the USDT probes of the default hooks.
+    unsigned long numProbes = TimSortStubProbeCount();
+    TimSort(gold.begin(), gold.end());
+    if (TimSortStubProbeCount() == numProbes) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortHooks FAIL! No probe fired";
+    }
+#endif
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortPhaseTimes()
+{
+    const size_t kNumElems = 100000;
+    TestState state;
+    state.mMsg = "TestTimSortPhaseTimes\t PASS!";
+
+    vector<int> v;
+    vector<int> gold;
+    MakeMixedRuns(kNumElems, 1000, v, gold);
+
+    TimSortClearPhaseTimes();
+    TimSortTimed(v.begin(), v.end());
+    TimSortPhaseTimes times = TimSortGetPhaseTimes();
+
+    if (v != gold || times.mNumSorts != 1 || times.mNumElems != kNumElems ||
+        times.mTicks[kTimPhaseRunDetection] == 0 || times.mTicks[kTimPhaseBoosting] == 0 ||
+        times.mTicks[kTimPhaseMerging] == 0 || times.mTicks[kTimPhaseGalloping] == 0 ||
+        times.mTickUnit != TimSortPhaseTimes::GetPlatformTickUnit()) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortPhaseTimes FAIL! Merge path";
+        return state;
+    }
+
+    // The low cardinality path is charged to the other phase, and the totals accumulate.
+    vector<int> few(kNumElems);
+    for (size_t i = 0; i < kNumElems; ++i) {
+        few[i] = rand() % 10;
+    }
+    gold = few;
+    sort(gold.begin(), gold.end());
+
+    TimSortTimed(few.begin(), few.end());
+    const TimSortPhaseTimes &total = TimSortGetPhaseTimes();
+    if (few != gold || total.mNumSorts != 2 || total.mNumElems != 2 * kNumElems ||
+        total.mTicks[kTimPhaseOther] <= times.mTicks[kTimPhaseOther] ||
+        total.mTicks[kTimPhaseMerging] != times.mTicks[kTimPhaseMerging]) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortPhaseTimes FAIL! Low cardinality path";
+        return state;
+    }
+
+    TimSortClearPhaseTimes();
+    if (TimSortGetPhaseTimes().mNumSorts != 0) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortPhaseTimes FAIL! Clear";
+    }
+
+#ifdef TIMSORT_THREAD_LOCAL
+    state.mIsFail = true;
+    state.mMsg = "TestTimSortPhaseTimes FAIL! TIMSORT_THREAD_LOCAL leaks out of timsort.h";
+#endif
+
+    return state;
+}
+
+TestState TimSortUT::TestTimSortMergeTree()
+{
+    const size_t kNumElems = 100000;
+    TestState state;
+    state.mMsg = "TestTimSortMergeTree\t PASS!";
+
+    vector<int> v;
+    vector<int> gold;
+    MakeMixedRuns(kNumElems, 1000, v, gold);
+
+    TimSortMergeTree<vector<int>::iterator> tree;
+    TimSort(v.begin(), v.end(), less<int>(), tree);
+    const vector<TimSortMergeTreeNode> &nodes = tree.GetNodes();
+
+    // The runs tile the range in order, and each merge covers its two runs, which are adjacent.
+    size_t numRuns = 0;
+    size_t numBoostedRuns = 0;
+    size_t next = 0;
+    bool isValid = tree.GetRoot() == nodes.size() - 1 && nodes.back().mFirst == 0 && nodes.back().mLength == kNumElems;
+    for (size_t id = 0; id < nodes.size() && isValid; ++id) {
+        const TimSortMergeTreeNode &node = nodes[id];
+        if (node.mIsMerge) {
+            const TimSortMergeTreeNode &left = nodes[node.mLeft];
+            const TimSortMergeTreeNode &right = nodes[node.mRight];
+            isValid = node.mLeft < id && node.mRight < id && left.mFirst == node.mFirst &&
+                      right.mFirst == left.mFirst + left.mLength && node.mLength == left.mLength + right.mLength &&
+                      node.GetGallopFraction() <= 1.0;
+        } else {
+            isValid = node.mFirst == next && node.mNaturalLength <= node.mLength;
+            next += node.mLength;
+            ++numRuns;
+            numBoostedRuns += node.mLength > node.mNaturalLength;
+        }
+    }
+
+    stringstream json;
+    stringstream dot;
+    tree.WriteJson(json);
+    tree.WriteDot(dot);
+    size_t numEdges = 0;
+    for (size_t p = dot.str().find("->"); p != string::npos; p = dot.str().find("->", p + 2)) {
+        ++numEdges;
+    }
+
+    if (v != gold || isValid == false || next != kNumElems || numBoostedRuns == 0 || nodes.size() != 2 * numRuns - 1 ||
+        json.str().find("\"root\": " + ToString(tree.GetRoot())) == string::npos || numEdges != 2 * (numRuns - 1)) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortMergeTree FAIL!";
+        return state;
+    }
+
+    // The low cardinality path merges nothing.
+    for (size_t i = 0; i < kNumElems; ++i) {
+        v[i] = rand() % 10;
+    }
+    TimSort(v.begin(), v.end(), less<int>(), tree);
+    if (tree.GetNodes().empty() == false || tree.GetRoot() != TimSortMergeTreeNode::kNone) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortMergeTree FAIL! Low cardinality path";
+        return state;
+    }
+
+    // Unless the grouping path gives up late: its grouped prefix is the first run, merged with the runs of the rest.
+    MakeLateManyDistinct(16384, v, gold);
+    TimSortMergeTree<vector<int>::iterator> lateTree;
+    TimSort(v.begin(), v.end(), CountingLess(), lateTree);
+    const vector<TimSortMergeTreeNode> &lateNodes = lateTree.GetNodes();
+    numRuns = 0;
+    for (size_t id = 0; id < lateNodes.size(); ++id) {
+        numRuns += lateNodes[id].mIsMerge == false;
+    }
+    if (v != gold || lateNodes.size() < 3 || lateNodes.size() != 2 * numRuns - 1 ||
+        lateTree.GetRoot() != lateNodes.size() - 1 || lateNodes.back().mLength != v.size() ||
+        lateNodes[0].mIsMerge || lateNodes[0].mFirst != 0 || lateNodes[0].mLength < v.size() / 2) {
+        state.mIsFail = true;
+        state.mMsg = "TestTimSortMergeTree FAIL! Late give up of the grouping path";
+    }
+
+    return state;
+}
+
+static size_t gNumFailures = 0;
+
+void PrintFailureMsg(const TestState &state)
+{
+    if (state.mIsFail) {
+        ++gNumFailures;
+    }
+    if (state.mMsg.empty() == false) {
+        cerr << state.mMsg << endl;
+    }
+}
+
+int main()
+{
+    srand(time(NULL));
+    TestState state;
+
+    //state = TimSortUT::TestInsertionSort();
+    PrintFailureMsg(state);
+
+    //state = TimSortUT::TestCalcMinRunLength();
+    PrintFailureMsg(state);
+
+    //state = TimSortUT::TestGallop();
+    PrintFailureMsg(state);
+
+    //state = TimSortUT::TestMerge(true);
+    PrintFailureMsg(state);
+
+    //state = TimSortUT::TestMerge(false);
+    PrintFailureMsg(state);
+
+    //state = TimSortUT::TestTryMerge();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSort();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortAppend();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortExternal();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestStreamingTimSort();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimPartialSort();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimMergeK();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimMerge();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestMinGallop();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSetOperations();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimFingerSearch();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimMergeJoin();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortUnique();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortReduce();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortCountInversions();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortFewDistinct();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortBounded();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortReorderBuffer();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortStats();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortHooks();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortPhaseTimes();
+    PrintFailureMsg(state);
+
+    state = TimSortUT::TestTimSortMergeTree();
     PrintFailureMsg(state);
 
-    return 0;
+    // Fail make test if any test failed.
+    return gNumFailures == 0 ? 0 : 1;
 }